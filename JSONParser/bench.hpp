@@ -0,0 +1,380 @@
+#pragma once
+
+#include "columns.hpp"
+#include "json.hpp"
+#include "writer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Counts dTLB load misses of this thread while it lives, when the kernel
+// lets it; count() is nullopt otherwise
+struct TLBCounter {
+  TLBCounter();
+  TLBCounter(TLBCounter const &) = delete;
+  TLBCounter &operator=(TLBCounter const &) = delete;
+  ~TLBCounter();
+
+  void start();
+  std::optional<uint64_t> count();
+
+  int fd = -1;
+};
+
+void bench_parse(std::string_view json, unsigned max_jobs);
+
+// Time parsing json with its input and arena on small pages, then on huge
+// pages, with the dTLB load misses of each where the kernel counts them
+void bench_pages(std::string_view json);
+
+// Time parsing json with and without counted container sizes, and report
+// the growth of unsized containers the counts avoid
+void bench_presize(std::string_view json);
+
+// Time parsing json and writing it back, with numbers converted and with
+// numbers kept as text
+void bench_passthrough(std::string_view json);
+
+// Time building and iterating the objects of json as JSONDICT and as a
+// node-based hash map
+void bench_dicts(std::string_view json);
+
+// Time parse() against a reused Parser on count messages, taken in turn
+// from the records of json
+void bench_messages(std::string_view json, size_t count);
+
+inline void bench_messages(std::string_view json, size_t count) {
+  using clock = std::chrono::steady_clock;
+
+  auto spans = record_spans(json);
+  if (spans.empty()) {
+    std::cerr << "No records to parse.";
+    return;
+  }
+  size_t bytes = 0;
+  for (size_t k = 0; k < count; ++k) {
+    bytes += spans[k % spans.size()].size();
+  }
+
+  auto time = [&](auto &&parse_one) {
+    auto t0 = clock::now();
+    for (size_t k = 0; k < count; ++k) {
+      if (parse_one(spans[k % spans.size()]) == 0) {
+        return -1.0;
+      }
+    }
+    std::chrono::duration<double> took = clock::now() - t0;
+    return took.count();
+  };
+
+  double fresh = time([](std::string_view msg) { return parse(msg).second; });
+  Parser parser;
+  double reused = time(
+      [&parser](std::string_view msg) { return parser.parse(msg).second; });
+  if (fresh < 0 || reused < 0) {
+    std::cerr << "Invalid JSON.";
+    return;
+  }
+
+  auto ns = [count](double sec) {
+    return sec * 1e9 / static_cast<double>(count);
+  };
+  auto mbs = [bytes](double sec) {
+    return static_cast<double>(bytes) / sec / 1e6;
+  };
+  print("parser", "ns/msg", "MB/s");
+  print("parse()", ns(fresh), mbs(fresh));
+  print("Parser", ns(reused), mbs(reused));
+}
+
+inline void bench_parse(std::string_view json, unsigned max_jobs) {
+  using clock = std::chrono::steady_clock;
+
+  double base_ms = 0;
+  print("jobs", "ms", "speedup");
+  for (unsigned jobs = 1; jobs <= max_jobs; ++jobs) {
+    double best_ms = 0;
+    for (int round = 0; round < 3; ++round) {
+      auto t0 = clock::now();
+      auto [obj, eaten] = parse_parallel(json, jobs);
+      std::chrono::duration<double, std::milli> took = clock::now() - t0;
+      if (eaten == 0) {
+        std::cerr << "Invalid JSON.";
+        return;
+      }
+      if (round == 0 || took.count() < best_ms) {
+        best_ms = took.count();
+      }
+    }
+    if (jobs == 1) {
+      base_ms = best_ms;
+    }
+    print(jobs, best_ms, base_ms / best_ms);
+  }
+}
+
+inline TLBCounter::TLBCounter() {
+  perf_event_attr attr{};
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+inline TLBCounter::~TLBCounter() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+inline void TLBCounter::start() {
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+inline std::optional<uint64_t> TLBCounter::count() {
+  uint64_t misses = 0;
+  if (fd < 0) {
+    return std::nullopt;
+  }
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+    return std::nullopt;
+  }
+  return misses;
+}
+
+inline void bench_pages(std::string_view json) {
+  using clock = std::chrono::steady_clock;
+
+  print("pages", "ms", "dTLB misses", "THP");
+  for (bool huge : {false, true}) {
+    // Each run gets its own copy, so both read from freshly mapped memory
+    PageBuffer input(json.size(), huge);
+    std::copy(json.begin(), json.end(), input.data);
+    Parser parser;
+    parser.arena.huge = huge;
+
+    double best_ms = 0;
+    std::optional<uint64_t> best_misses;
+    TLBCounter tlb;
+    for (int round = 0; round < 3; ++round) {
+      tlb.start();
+      auto t0 = clock::now();
+      size_t eaten = parser.parse(input.view()).second;
+      std::chrono::duration<double, std::milli> took = clock::now() - t0;
+      auto misses = tlb.count();
+      if (eaten == 0) {
+        std::cerr << "Invalid JSON.";
+        return;
+      }
+      if (round == 0 || took.count() < best_ms) {
+        best_ms = took.count();
+        best_misses = misses;
+      }
+    }
+
+    // The arena's blocks are only taken by THP if the kernel allows it
+    bool advised = input.huge && std::all_of(parser.arena.blocks.begin(),
+                                             parser.arena.blocks.end(),
+                                             [](auto &b) { return b.huge; });
+    char const *name = huge ? "2 MB" : "4 KB";
+    char const *thp = huge ? (advised ? "advised" : "unavailable") : "-";
+    if (best_misses) {
+      print(name, best_ms, *best_misses, thp);
+    } else {
+      print(name, best_ms, "n/a", thp);
+    }
+  }
+}
+
+inline void bench_passthrough(std::string_view json) {
+  using clock = std::chrono::steady_clock;
+
+  print("numbers", "ms", "MB/s");
+  for (bool raw : {false, true}) {
+    ParseOptions opts;
+    opts.raw_numbers = raw;
+    double best_ms = -1;
+    for (int round = 0; round < 3; ++round) {
+      std::string out;
+      auto t0 = clock::now();
+      auto [obj, eaten] = parse(json, opts);
+      dump(obj, out);
+      std::chrono::duration<double, std::milli> took = clock::now() - t0;
+      if (eaten == 0) {
+        std::cerr << "Invalid JSON.";
+        return;
+      }
+      if (best_ms < 0 || took.count() < best_ms) {
+        best_ms = took.count();
+      }
+    }
+    print(raw ? "raw" : "converted", best_ms,
+          static_cast<double>(json.size()) / best_ms / 1e3);
+  }
+}
+
+inline void bench_dicts(std::string_view json) {
+  using clock = std::chrono::steady_clock;
+
+  auto [doc, eaten] = parse(json);
+  if (eaten == 0) {
+    std::cerr << "Invalid JSON.";
+    return;
+  }
+
+  // Keys of every object in the document, rebuilt by each round
+  std::vector<std::vector<std::string_view>> objects;
+  auto collect = [&objects](JSONObject const &obj, auto &self) -> void {
+    if (auto dict = std::get_if<JSONDICT>(&obj.inner)) {
+      objects.emplace_back();
+      for (auto const &[k, v] : *dict) {
+        objects.back().push_back(k);
+        self(v, self);
+      }
+    } else if (auto rec = std::get_if<JSONRecord>(&obj.inner)) {
+      objects.emplace_back();
+      for (size_t k = 0; k < rec->values.size(); ++k) {
+        objects.back().push_back(rec->shape->keys[k]);
+        self(rec->values[k], self);
+      }
+    } else if (auto list = std::get_if<JSONLIST>(&obj.inner)) {
+      for (auto const &member : *list) {
+        self(member, self);
+      }
+    }
+  };
+  collect(doc, collect);
+
+  auto best_ms = [&objects](auto make) {
+    double best = -1;
+    size_t sum = 0;
+    for (int round = 0; round < 3; ++round) {
+      auto t0 = clock::now();
+      for (auto const &keys : objects) {
+        auto dict = make();
+        for (auto key : keys) {
+          dict.try_emplace(JSONString(key), JSONObject{nullptr});
+        }
+        for (auto const &[k, v] : dict) {
+          sum += k.size();
+        }
+      }
+      std::chrono::duration<double, std::milli> took = clock::now() - t0;
+      if (best < 0 || took.count() < best) {
+        best = took.count();
+      }
+    }
+    return std::pair{best, sum};
+  };
+
+  auto ordered = best_ms([] { return JSONDICT(); });
+  auto hashed = best_ms(
+      [] { return std::pmr::unordered_map<JSONString, JSONObject>(); });
+  print(objects.size(), "objects", "ms");
+  print("ordered", ordered.first);
+  print("hashed", hashed.first);
+  if (ordered.second != hashed.second) {
+    std::cerr << "Dicts differ.";
+  }
+}
+
+inline void bench_presize(std::string_view json) {
+  using clock = std::chrono::steady_clock;
+
+  auto best_ms = [json](bool counted) {
+    double best = -1;
+    for (int round = 0; round < 3; ++round) {
+      auto t0 = clock::now();
+      ContainerSizes sizes;
+      ParseOptions opts;
+      if (counted) {
+        sizes = ContainerSizes::count(json);
+        opts.sizes = &sizes;
+      }
+      size_t eaten = parse(json, opts).second;
+      std::chrono::duration<double, std::milli> took = clock::now() - t0;
+      if (eaten == 0) {
+        return -1.0;
+      }
+      if (best < 0 || took.count() < best) {
+        best = took.count();
+      }
+    }
+    return best;
+  };
+
+  double grown = best_ms(false);
+  double counted = best_ms(true);
+  if (grown < 0 || counted < 0) {
+    std::cerr << "Invalid JSON.";
+    return;
+  }
+
+  // Replay on empty containers how the unsized ones grow, recording the
+  // sizes at which an insert reallocated or reindexed
+  ContainerSizes sizes = ContainerSizes::count(json);
+  size_t most = 0;
+  for (auto [offset, size] : sizes.sizes) {
+    most = std::max(most, size);
+  }
+  std::vector<size_t> list_growth, dict_growth;
+  std::vector<char> list;
+  JSONDICT dict;
+  for (size_t k = 0; k < most; ++k) {
+    size_t capacity = list.capacity(), entries = dict.capacity();
+    list.push_back(0);
+    dict.try_emplace(JSONString(std::to_string(k)), JSONObject{nullptr});
+    if (list.capacity() != capacity) {
+      list_growth.push_back(k);
+    }
+    if (dict.capacity() != entries) {
+      dict_growth.push_back(k);
+    }
+  }
+
+  // A reserved container still allocates once, so the first growth of an
+  // unsized one is not counted as avoided
+  auto avoided = [](std::vector<size_t> const &growth, size_t size) {
+    auto steps = std::lower_bound(growth.begin(), growth.end(), size) -
+                 growth.begin();
+    return steps > 0 ? static_cast<size_t>(steps) - 1 : 0;
+  };
+  size_t lists = 0, dicts = 0, reallocations = 0, reindexes = 0;
+  for (auto [offset, size] : sizes.sizes) {
+    if (json[offset] == '[') {
+      lists += 1;
+      reallocations += avoided(list_growth, size);
+    } else {
+      dicts += 1;
+      reindexes += avoided(dict_growth, size);
+    }
+  }
+
+  print("sizes", "ms");
+  print("grown", grown);
+  print("counted", counted);
+  print(lists, "lists", reallocations, "reallocations avoided");
+  print(dicts, "dicts", reindexes, "reindexes avoided");
+}
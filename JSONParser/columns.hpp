@@ -0,0 +1,463 @@
+#pragma once
+
+#include "json.hpp"
+#include "writer.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// One key of a record array as a typed column. A column starts out as ints
+// and is promoted to doubles, then to dictionary-encoded strings holding
+// JSON text, as wider values show up; bools count as 0 and 1. A clear bit
+// in validity marks a row that is null or lacks the key.
+struct Column {
+  enum Kind { Int, Double, String };
+
+  std::string name{};
+  Kind kind = Int;
+  size_t size = 0;
+  std::vector<uint64_t> validity{};
+  std::vector<int> ints{};
+  std::vector<double> doubles{};
+  std::vector<uint32_t> codes{};
+  std::vector<std::string> dict{};
+  std::unordered_map<std::string, uint32_t> dict_index{};
+
+  bool valid(size_t row) const {
+    return (validity[row / 64] >> (row % 64)) & 1;
+  }
+
+  void push(JSONObject const &value);
+
+  // Append invalid rows up to rows
+  void pad(size_t rows);
+
+  void promote(Kind to);
+
+  // Append the rows of a column for the same key
+  void append(Column &&other);
+
+  uint32_t intern(std::string const &str);
+};
+
+// Running count, sum, min and max of the numbers seen for one group
+struct Aggregate {
+  size_t count = 0;
+  double sum = 0;
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+
+  void add(double num);
+  void merge(Aggregate const &other);
+};
+
+// Columns of a record array, in order of first appearance
+struct ColumnTable {
+  size_t rows = 0;
+  std::vector<Column> columns{};
+  std::unordered_map<std::string, size_t> index{};
+
+  // Append an object or record as one row; other values give an empty row
+  void append(JSONObject const &record);
+
+  void append(ColumnTable &&other);
+
+  Column &column(std::string const &name);
+
+  std::string csv() const;
+
+  // Native-endian layout: "JCOL" u64 rows u32 columns, then per column
+  // u32 name length, name, u8 kind, rows/64 rounded up u64 validity words,
+  // and the data: i32 or f64 per row, or u32 dictionary size, each entry
+  // as u32 length and bytes, then a u32 code per row.
+  std::string binary() const;
+};
+
+// Turn a JSON array of records, or NDJSON, into columns on several threads
+ColumnTable to_columns(std::string_view json, unsigned jobs);
+
+// Evaluate count, sum, min, max or avg of a field over all records, grouped
+// by the value of another field, as JSON text
+std::optional<std::string> aggregate(std::string_view json,
+                                     std::string_view verb,
+                                     std::string_view field,
+                                     std::string_view group_by, unsigned jobs);
+
+// Aggregate over count records, where value(k, tokens) is the value at a
+// path in record k, or nullopt when it has none
+template <class F>
+std::optional<std::string>
+aggregate_records(size_t count, std::string_view verb, std::string_view field,
+                  std::string_view group_by, unsigned jobs, F &&value);
+
+inline void Column::push(JSONObject const &value) {
+  JSONObject const &val = value.resolved();
+  bool is_null = std::holds_alternative<std::nullptr_t>(val.inner);
+  std::optional<int> num;
+  if (auto n = std::get_if<int>(&val.inner)) {
+    num = *n;
+  } else if (auto b = std::get_if<bool>(&val.inner)) {
+    num = *b ? 1 : 0;
+  }
+
+  if (auto d = std::get_if<double>(&val.inner); d && kind != String) {
+    promote(Double);
+    doubles.push_back(*d);
+  } else if ((num.has_value() || is_null) && kind == Int) {
+    ints.push_back(num.value_or(0));
+  } else if ((num.has_value() || is_null) && kind == Double) {
+    doubles.push_back(num.value_or(0));
+  } else if (is_null) {
+    codes.push_back(0);
+  } else {
+    promote(String);
+    if (val.is_string()) {
+      codes.push_back(intern(std::string(val.str())));
+    } else {
+      std::string text;
+      dump(val, text);
+      codes.push_back(intern(text));
+    }
+  }
+
+  if (size % 64 == 0) {
+    validity.push_back(0);
+  }
+  if (!is_null) {
+    validity.back() |= uint64_t{1} << (size % 64);
+  }
+  size += 1;
+}
+
+inline void Column::pad(size_t rows) {
+  while (size < rows) {
+    push(JSONObject{nullptr});
+  }
+}
+
+inline void Column::promote(Kind to) {
+  if (to <= kind) {
+    return;
+  }
+
+  if (to == Double) {
+    doubles.assign(ints.begin(), ints.end());
+  } else {
+    codes.reserve(size);
+    for (size_t row = 0; row < size; ++row) {
+      std::string text;
+      if (kind == Int) {
+        dump_number(ints[row], text);
+      } else {
+        dump_number(doubles[row], text);
+      }
+      codes.push_back(valid(row) ? intern(text) : 0);
+    }
+    doubles = {};
+  }
+  ints = {};
+  kind = to;
+}
+
+inline void Column::append(Column &&other) {
+  Kind to = std::max(kind, other.kind);
+  promote(to);
+  other.promote(to);
+
+  std::vector<uint32_t> remap;
+  if (to == String) {
+    remap.reserve(other.dict.size());
+    for (auto &str : other.dict) {
+      remap.push_back(intern(str));
+    }
+  }
+
+  for (size_t row = 0; row < other.size; ++row) {
+    if (size % 64 == 0) {
+      validity.push_back(0);
+    }
+    bool ok = other.valid(row);
+    if (ok) {
+      validity.back() |= uint64_t{1} << (size % 64);
+    }
+    size += 1;
+
+    if (to == Int) {
+      ints.push_back(other.ints[row]);
+    } else if (to == Double) {
+      doubles.push_back(other.doubles[row]);
+    } else {
+      codes.push_back(ok ? remap[other.codes[row]] : 0);
+    }
+  }
+}
+
+inline uint32_t Column::intern(std::string const &str) {
+  auto [it, added] =
+      dict_index.try_emplace(str, static_cast<uint32_t>(dict.size()));
+  if (added) {
+    dict.push_back(str);
+  }
+  return it->second;
+}
+
+inline Column &ColumnTable::column(std::string const &name) {
+  auto [it, added] = index.try_emplace(name, columns.size());
+  if (added) {
+    columns.push_back(Column{});
+    columns.back().name = name;
+    columns.back().pad(rows);
+  }
+  return columns[it->second];
+}
+
+inline void ColumnTable::append(JSONObject const &record) {
+  JSONObject const &obj = record.resolved();
+  if (auto rec = std::get_if<JSONRecord>(&obj.inner)) {
+    for (size_t k = 0; k < rec->values.size(); ++k) {
+      column(rec->shape->keys[k]).push(rec->values[k]);
+    }
+  } else if (auto dict = std::get_if<JSONDICT>(&obj.inner)) {
+    for (auto const &[k, v] : *dict) {
+      column(std::string(k)).push(v);
+    }
+  }
+
+  rows += 1;
+  for (auto &col : columns) {
+    col.pad(rows);
+  }
+}
+
+inline void ColumnTable::append(ColumnTable &&other) {
+  for (auto &col : other.columns) {
+    column(col.name).append(std::move(col));
+  }
+  rows += other.rows;
+  for (auto &col : columns) {
+    col.pad(rows);
+  }
+}
+
+inline std::string ColumnTable::csv() const {
+  auto quote = [](std::string_view field, std::string &out) {
+    if (field.find_first_of(",\"\r\n") == field.npos) {
+      out += field;
+      return;
+    }
+    out += '"';
+    for (char ch : field) {
+      out += ch;
+      if (ch == '"') {
+        out += '"';
+      }
+    }
+    out += '"';
+  };
+
+  std::string out;
+  for (size_t c = 0; c < columns.size(); ++c) {
+    out += c != 0 ? "," : "";
+    quote(columns[c].name, out);
+  }
+  out += '\n';
+
+  for (size_t row = 0; row < rows; ++row) {
+    for (size_t c = 0; c < columns.size(); ++c) {
+      auto const &col = columns[c];
+      out += c != 0 ? "," : "";
+      if (!col.valid(row)) {
+        continue;
+      }
+      if (col.kind == Column::Int) {
+        dump_number(col.ints[row], out);
+      } else if (col.kind == Column::Double) {
+        dump_number(col.doubles[row], out);
+      } else {
+        quote(col.dict[col.codes[row]], out);
+      }
+    }
+    out += '\n';
+  }
+  return out;
+}
+
+inline std::string ColumnTable::binary() const {
+  std::string out = "JCOL";
+  auto put = [&out](auto num) {
+    out.append(reinterpret_cast<char const *>(&num), sizeof(num));
+  };
+  auto put_array = [&out](auto const &vec) {
+    out.append(reinterpret_cast<char const *>(vec.data()),
+               vec.size() * sizeof(vec[0]));
+  };
+
+  put(uint64_t{rows});
+  put(static_cast<uint32_t>(columns.size()));
+  for (auto const &col : columns) {
+    put(static_cast<uint32_t>(col.name.size()));
+    out += col.name;
+    put(static_cast<uint8_t>(col.kind));
+    put_array(col.validity);
+    if (col.kind == Column::Int) {
+      put_array(col.ints);
+    } else if (col.kind == Column::Double) {
+      put_array(col.doubles);
+    } else {
+      put(static_cast<uint32_t>(col.dict.size()));
+      for (auto const &str : col.dict) {
+        put(static_cast<uint32_t>(str.size()));
+        out += str;
+      }
+      put_array(col.codes);
+    }
+  }
+  return out;
+}
+
+inline ColumnTable to_columns(std::string_view json, unsigned jobs) {
+  auto spans = record_spans(json);
+
+  // Every task fills a table of its own; they are joined in record order
+  size_t per_task = std::max<size_t>(spans.size() / (size_t{jobs} * 8), 64);
+  std::vector<ColumnTable> parts((spans.size() + per_task - 1) / per_task);
+  run_tasks(parts.size(), jobs, [&](size_t t) {
+    size_t end = std::min(spans.size(), (t + 1) * per_task);
+    for (size_t k = t * per_task; k < end; ++k) {
+      parts[t].append(parse(spans[k]).first);
+    }
+  });
+
+  ColumnTable table;
+  for (auto &part : parts) {
+    table.append(std::move(part));
+  }
+  return table;
+}
+
+inline void Aggregate::add(double num) {
+  count += 1;
+  sum += num;
+  min = std::min(min, num);
+  max = std::max(max, num);
+}
+
+inline void Aggregate::merge(Aggregate const &other) {
+  count += other.count;
+  sum += other.sum;
+  min = std::min(min, other.min);
+  max = std::max(max, other.max);
+}
+
+inline std::optional<std::string> aggregate(std::string_view json,
+                                            std::string_view verb,
+                                            std::string_view field,
+                                            std::string_view group_by,
+                                            unsigned jobs) {
+  // Only the two referenced fields of each record are ever decoded
+  auto spans = record_spans(json);
+  return aggregate_records(
+      spans.size(), verb, field, group_by, jobs,
+      [&spans](size_t k, std::vector<std::string> const &tokens)
+          -> std::optional<JSONObject> {
+        auto raw = project(spans[k], tokens);
+        if (!raw) {
+          return std::nullopt;
+        }
+        return parse(*raw).first;
+      });
+}
+
+template <class F>
+std::optional<std::string>
+aggregate_records(size_t count, std::string_view verb, std::string_view field,
+                  std::string_view group_by, unsigned jobs, F &&value) {
+  auto field_tokens = split_path(field);
+  auto group_tokens = split_path(group_by);
+  bool count_records = verb == "count" && field.empty();
+  if (!field_tokens.has_value() || !group_tokens.has_value() ||
+      (field.empty() && !count_records)) {
+    return std::nullopt;
+  }
+
+  using Groups = std::map<std::string, Aggregate>;
+  size_t per_task = std::max<size_t>(count / (size_t{jobs} * 8), 64);
+  std::vector<Groups> parts((count + per_task - 1) / per_task);
+  run_tasks(parts.size(), jobs, [&](size_t t) {
+    size_t end = std::min(count, (t + 1) * per_task);
+    for (size_t k = t * per_task; k < end; ++k) {
+      std::string key;
+      if (!group_by.empty()) {
+        auto group = value(k, *group_tokens);
+        key = group_text(group ? *group : JSONObject{nullptr});
+      }
+
+      Aggregate &agg = parts[t][key];
+      if (count_records) {
+        agg.add(0);
+        continue;
+      }
+      auto found = value(k, *field_tokens);
+      if (!found) {
+        continue;
+      }
+      JSONObject const &val = *found;
+      if (auto n = std::get_if<int>(&val.inner)) {
+        agg.add(*n);
+      } else if (auto d = std::get_if<double>(&val.inner)) {
+        agg.add(*d);
+      } else if (auto dec = std::get_if<JSONDecimal>(&val.inner)) {
+        agg.add(dec->to_double());
+      } else if (verb == "count" &&
+                 !std::holds_alternative<std::nullptr_t>(val.inner)) {
+        agg.add(0);
+      }
+    }
+  });
+
+  Groups groups;
+  for (auto const &part : parts) {
+    for (auto const &[key, agg] : part) {
+      groups[key].merge(agg);
+    }
+  }
+
+  JSONWriter writer;
+  auto result = [&verb, &writer](Aggregate const &agg) {
+    if (verb == "count") {
+      writer.value(static_cast<double>(agg.count));
+    } else if (verb == "sum") {
+      writer.value(agg.sum);
+    } else if (agg.count == 0) {
+      writer.value(nullptr);
+    } else if (verb == "min") {
+      writer.value(agg.min);
+    } else if (verb == "max") {
+      writer.value(agg.max);
+    } else {
+      writer.value(agg.sum / static_cast<double>(agg.count));
+    }
+  };
+
+  if (group_by.empty()) {
+    result(groups[""]);
+    return writer.buffer;
+  }
+
+  writer.begin_object();
+  for (auto const &[key, agg] : groups) {
+    writer.key(key);
+    result(agg);
+  }
+  writer.end_object();
+  return writer.buffer;
+}
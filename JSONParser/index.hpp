@@ -0,0 +1,573 @@
+#pragma once
+
+#include "json.hpp"
+#include "memory.hpp"
+#include "writer.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// A file mapped read-only, or an empty view when it cannot be opened
+struct MappedFile {
+  char *data = nullptr;
+  size_t size = 0;
+  bool opened = false; // false when the file could not be read or mapped
+
+  explicit MappedFile(std::string const &path);
+  MappedFile(MappedFile const &) = delete;
+  MappedFile &operator=(MappedFile const &) = delete;
+  ~MappedFile();
+
+  std::string_view view() const { return {data, size}; }
+};
+
+// Sidecar index of an NDJSON file: the byte offset of every n-th record
+// and, when built on a key field, the offset of every record that has it
+// sorted by a hash of its value. Lookups read the index bytes in place.
+//
+// Native-endian layout: "JIDX" u32 version, u64 file size, records, every,
+// offset count, key length and keyed count, then the offsets, the key
+// padded to 8 bytes, and u64 (hash, offset) pairs in ascending order. The
+// hashes are of key_text, so version 1 indexes, which hashed strings
+// without their quotes, are not read.
+struct RecordIndex {
+  static constexpr size_t header_size = 56;
+
+  std::string_view bytes{};
+  uint64_t file_size = 0;
+  uint64_t records = 0;
+  uint64_t every = 0;
+  std::string_view key{};
+  uint64_t keyed_count = 0;
+  size_t keyed_at = 0;
+
+  // Index the records of ndjson on several threads, or nullopt when key is
+  // not a valid path
+  static std::optional<std::string> build(std::string_view ndjson,
+                                          uint64_t every, std::string_view key,
+                                          unsigned jobs);
+
+  // Read an index built by build(), or nullopt when bytes are not one
+  static std::optional<RecordIndex> load(std::string_view bytes);
+
+  uint64_t word(size_t at) const;
+
+  // Offset of the last indexed record at or before record k
+  uint64_t offset(uint64_t k) const;
+
+  // Offsets of the records whose key value hashes to hash, in file order
+  std::vector<uint64_t> lookup(uint64_t hash) const;
+};
+
+// Bloom filters over the keys and short string values of blocks of NDJSON
+// records, so that a search only parses the blocks that may hold a match.
+//
+// Native-endian layout: "JBLM" u32 version, u64 file size and block count,
+// then u64 begin, end, first word and word count per block, and the u64
+// filter words of all blocks.
+struct BloomIndex {
+  // Longer strings are not added and always have to be searched for
+  static constexpr size_t max_length = 64;
+  static constexpr unsigned hashes = 7;
+  static constexpr size_t header_size = 24;
+
+  struct Block {
+    uint64_t begin;
+    uint64_t end;
+    uint64_t first_word;
+    uint64_t words;
+  };
+
+  std::string_view bytes{};
+  uint64_t file_size = 0;
+  std::vector<Block> blocks{};
+  size_t words_at = 0;
+
+  // Split ndjson into blocks of whole records and fill their filters on
+  // several threads
+  static std::string build(std::string_view ndjson, size_t block_size,
+                           unsigned jobs);
+
+  // Read filters built by build(), or nullopt when bytes are not any
+  static std::optional<BloomIndex> load(std::string_view bytes);
+
+  // False when block b surely holds no key or string equal to str
+  bool may_contain(size_t b, std::string_view str) const;
+};
+
+// 64-bit FNV-1a, which is stable across builds and so can be stored
+uint64_t fnv1a(std::string_view str);
+
+// Record k of NDJSON, sought from the nearest indexed offset when there is
+// an index
+std::optional<std::string_view>
+find_record(std::string_view ndjson, RecordIndex const *index, uint64_t k);
+
+// Records whose field equals value, taken as JSON or else as a string. Uses
+// the index when it is keyed on the same path as field, however either is
+// written, and scans every record otherwise.
+std::optional<std::vector<std::string_view>>
+find_records(std::string_view ndjson, RecordIndex const *index,
+             std::string_view field, std::string_view value, unsigned jobs);
+
+// Start of the first line at or after pos
+size_t line_start(std::string_view text, size_t pos);
+
+// Split text into ranges of whole lines about size bytes long
+std::vector<std::pair<size_t, size_t>> line_blocks(std::string_view text,
+                                                   size_t size);
+
+// Call visit with every string of json, keys included, unescaped
+template <class F> void each_string(std::string_view json, F &&visit);
+
+// Records holding needle as a key or a string value. Only the blocks whose
+// filter may contain it are parsed when there are filters.
+std::vector<std::string_view> find_containing(std::string_view ndjson,
+                                              BloomIndex const *bloom,
+                                              std::string_view needle,
+                                              unsigned jobs);
+
+inline MappedFile::MappedFile(std::string const &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    opened = st.st_size == 0;
+    if (st.st_size > 0) {
+      auto length = static_cast<size_t>(st.st_size);
+      void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        data = static_cast<char *>(addr);
+        size = length;
+        opened = true;
+      }
+    }
+  }
+  close(fd);
+}
+
+inline MappedFile::~MappedFile() {
+  if (data) {
+    munmap(data, size);
+  }
+}
+
+inline uint64_t fnv1a(std::string_view str) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (char c : str) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+inline std::optional<std::string> RecordIndex::build(std::string_view ndjson,
+                                                     uint64_t every,
+                                                     std::string_view key,
+                                                     unsigned jobs) {
+  auto tokens = split_path(key);
+  if (!tokens.has_value()) {
+    return std::nullopt;
+  }
+  every = std::max<uint64_t>(every, 1);
+
+  // Each chunk owns the records whose line starts inside it
+  size_t chunk_size = std::max<size_t>(
+      ndjson.size() / (size_t{jobs} * 8) + 1, size_t{1} << 16);
+  size_t chunks = (ndjson.size() + chunk_size - 1) / chunk_size;
+  auto each_record = [&](size_t c, auto &&visit) {
+    size_t from = c * chunk_size;
+    size_t end = std::min(ndjson.size(), from + chunk_size);
+    from = line_start(ndjson, from);
+    while (auto line = next_record(ndjson, from)) {
+      auto at = static_cast<size_t>(line->data() - ndjson.data());
+      if (at >= end) {
+        break;
+      }
+      visit(at, *line);
+    }
+  };
+
+  // Count the records of every chunk first so that each one knows the
+  // number of its first record when it is scanned again
+  std::vector<uint64_t> first(chunks + 1);
+  run_tasks(chunks, jobs, [&](size_t c) {
+    each_record(c, [&](size_t, std::string_view) { ++first[c + 1]; });
+  });
+  for (size_t c = 0; c < chunks; ++c) {
+    first[c + 1] += first[c];
+  }
+  uint64_t records = first[chunks];
+
+  std::vector<uint64_t> offsets((records + every - 1) / every);
+  std::vector<std::vector<std::pair<uint64_t, uint64_t>>> parts(chunks);
+  run_tasks(chunks, jobs, [&](size_t c) {
+    uint64_t k = first[c];
+    each_record(c, [&](size_t at, std::string_view line) {
+      if (k++ % every == 0) {
+        offsets[(k - 1) / every] = at;
+      }
+      if (key.empty()) {
+        return;
+      }
+      if (auto raw = project(line, *tokens)) {
+        parts[c].emplace_back(fnv1a(key_text(parse(*raw).first)), at);
+      }
+    });
+  });
+
+  std::vector<std::pair<uint64_t, uint64_t>> keyed;
+  for (auto &part : parts) {
+    keyed.insert(keyed.end(), part.begin(), part.end());
+  }
+  std::sort(keyed.begin(), keyed.end());
+
+  std::string out = "JIDX";
+  auto put = [&out](auto num) {
+    out.append(reinterpret_cast<char const *>(&num), sizeof(num));
+  };
+  put(uint32_t{2});
+  put(uint64_t{ndjson.size()});
+  put(records);
+  put(every);
+  put(uint64_t{offsets.size()});
+  put(uint64_t{key.size()});
+  put(uint64_t{keyed.size()});
+  for (uint64_t at : offsets) {
+    put(at);
+  }
+  out += key;
+  out.append((8 - key.size() % 8) % 8, '\0');
+  for (auto [hash, at] : keyed) {
+    put(hash);
+    put(at);
+  }
+  return out;
+}
+
+inline std::optional<RecordIndex> RecordIndex::load(std::string_view bytes) {
+  RecordIndex index;
+  index.bytes = bytes;
+  if (bytes.size() < header_size || bytes.substr(0, 4) != "JIDX") {
+    return std::nullopt;
+  }
+  uint32_t version;
+  std::memcpy(&version, bytes.data() + 4, sizeof(version));
+  index.file_size = index.word(8);
+  index.records = index.word(16);
+  index.every = index.word(24);
+  uint64_t offset_count = index.word(32);
+  uint64_t key_size = index.word(40);
+  index.keyed_count = index.word(48);
+
+  // Check every count before computing sizes from it
+  uint64_t limit = bytes.size();
+  if (version != 2 || index.every == 0 ||
+      offset_count != (index.records + index.every - 1) / index.every ||
+      offset_count > limit / 8 || key_size > limit ||
+      index.keyed_count > limit / 16) {
+    return std::nullopt;
+  }
+  size_t key_at = header_size + offset_count * 8;
+  index.keyed_at = key_at + (key_size + 7) / 8 * 8;
+  if (index.keyed_at + index.keyed_count * 16 != limit) {
+    return std::nullopt;
+  }
+  index.key = bytes.substr(key_at, key_size);
+  return index;
+}
+
+inline uint64_t RecordIndex::word(size_t at) const {
+  uint64_t num;
+  std::memcpy(&num, bytes.data() + at, sizeof(num));
+  return num;
+}
+
+inline uint64_t RecordIndex::offset(uint64_t k) const {
+  return word(header_size + k / every * 8);
+}
+
+inline std::vector<uint64_t> RecordIndex::lookup(uint64_t hash) const {
+  size_t lo = 0;
+  size_t hi = keyed_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (word(keyed_at + mid * 16) < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  std::vector<uint64_t> found;
+  for (; lo < keyed_count && word(keyed_at + lo * 16) == hash; ++lo) {
+    found.push_back(word(keyed_at + lo * 16 + 8));
+  }
+  return found;
+}
+
+inline std::optional<std::string_view>
+find_record(std::string_view ndjson, RecordIndex const *index, uint64_t k) {
+  size_t from = 0;
+  uint64_t skip = k;
+  if (index) {
+    if (k >= index->records) {
+      return std::nullopt;
+    }
+    from = index->offset(k);
+    skip = k % index->every;
+  }
+
+  std::optional<std::string_view> line;
+  do {
+    line = next_record(ndjson, from);
+  } while (line && skip-- > 0);
+  return line;
+}
+
+inline std::optional<std::vector<std::string_view>>
+find_records(std::string_view ndjson, RecordIndex const *index,
+             std::string_view field, std::string_view value, unsigned jobs) {
+  auto tokens = split_path(field);
+  if (field.empty() || !tokens.has_value()) {
+    return std::nullopt;
+  }
+  auto [parsed, eaten] = parse(value);
+  if (eaten != value.size()) {
+    parsed = JSONObject{JSONString(value)};
+  }
+  std::string wanted = key_text(parsed);
+  auto matches = [&](std::string_view line) {
+    auto raw = project(line, *tokens);
+    return raw && key_text(parse(*raw).first) == wanted;
+  };
+
+  std::vector<std::string_view> found;
+  if (index && split_path(index->key) == tokens) {
+    for (uint64_t at : index->lookup(fnv1a(wanted))) {
+      size_t from = at;
+      auto line = next_record(ndjson, from);
+      if (line && matches(*line)) {
+        found.push_back(*line);
+      }
+    }
+    return found;
+  }
+
+  auto spans = record_spans(ndjson);
+  size_t per_task = std::max<size_t>(spans.size() / (size_t{jobs} * 8), 64);
+  std::vector<std::vector<std::string_view>> parts(
+      (spans.size() + per_task - 1) / per_task);
+  run_tasks(parts.size(), jobs, [&](size_t t) {
+    size_t end = std::min(spans.size(), (t + 1) * per_task);
+    for (size_t k = t * per_task; k < end; ++k) {
+      if (matches(spans[k])) {
+        parts[t].push_back(spans[k]);
+      }
+    }
+  });
+  for (auto const &part : parts) {
+    found.insert(found.end(), part.begin(), part.end());
+  }
+  return found;
+}
+
+inline size_t line_start(std::string_view text, size_t pos) {
+  if (pos == 0 || pos >= text.size() || text[pos - 1] == '\n') {
+    return std::min(pos, text.size());
+  }
+  return std::min(text.find('\n', pos), text.size() - 1) + 1;
+}
+
+inline std::vector<std::pair<size_t, size_t>> line_blocks(std::string_view text,
+                                                          size_t size) {
+  std::vector<std::pair<size_t, size_t>> blocks;
+  for (size_t begin = 0; begin < text.size();) {
+    size_t end = line_start(text, begin + std::max<size_t>(size, 1));
+    blocks.emplace_back(begin, end);
+    begin = end;
+  }
+  return blocks;
+}
+
+template <class F> void each_string(std::string_view json, F &&visit) {
+  for (size_t pos = json.find('"'); pos < json.size();
+       pos = json.find('"', pos)) {
+    bool escaped = false;
+    size_t end = pos + 1;
+    for (; end < json.size() && json[end] != '"'; ++end) {
+      if (json[end] == '\\') {
+        escaped = true;
+        ++end;
+      }
+    }
+    if (end >= json.size()) {
+      return;
+    }
+    if (escaped) {
+      visit(parse(json.substr(pos, end + 1 - pos)).first.str());
+    } else {
+      visit(json.substr(pos + 1, end - pos - 1));
+    }
+    pos = end + 1;
+  }
+}
+
+inline std::string BloomIndex::build(std::string_view ndjson, size_t block_size,
+                                     unsigned jobs) {
+  std::vector<Block> blocks;
+  for (auto [begin, end] : line_blocks(ndjson, block_size)) {
+    blocks.push_back({begin, end, 0, 0});
+  }
+
+  // Filters get about ten bits per distinct string, for one false positive
+  // in a hundred
+  std::vector<std::vector<uint64_t>> filters(blocks.size());
+  run_tasks(blocks.size(), jobs, [&](size_t b) {
+    std::vector<uint64_t> hashed;
+    auto text = ndjson.substr(blocks[b].begin,
+                              blocks[b].end - blocks[b].begin);
+    each_string(text, [&](std::string_view str) {
+      if (str.size() <= max_length) {
+        hashed.push_back(fnv1a(str));
+      }
+    });
+    std::sort(hashed.begin(), hashed.end());
+    hashed.erase(std::unique(hashed.begin(), hashed.end()), hashed.end());
+
+    auto &words = filters[b];
+    words.resize(hashed.size() * 10 / 64 + 1);
+    uint64_t bits = words.size() * 64;
+    for (uint64_t hash : hashed) {
+      uint64_t step = (hash >> 33) | 1;
+      for (unsigned i = 0; i < hashes; ++i) {
+        uint64_t bit = (hash + i * step) % bits;
+        words[bit / 64] |= uint64_t{1} << (bit % 64);
+      }
+    }
+  });
+
+  uint64_t first_word = 0;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    blocks[b].first_word = first_word;
+    blocks[b].words = filters[b].size();
+    first_word += filters[b].size();
+  }
+
+  std::string out = "JBLM";
+  auto put = [&out](auto num) {
+    out.append(reinterpret_cast<char const *>(&num), sizeof(num));
+  };
+  put(uint32_t{1});
+  put(uint64_t{ndjson.size()});
+  put(uint64_t{blocks.size()});
+  for (auto const &block : blocks) {
+    put(block.begin);
+    put(block.end);
+    put(block.first_word);
+    put(block.words);
+  }
+  for (auto const &words : filters) {
+    for (uint64_t word : words) {
+      put(word);
+    }
+  }
+  return out;
+}
+
+inline std::optional<BloomIndex> BloomIndex::load(std::string_view bytes) {
+  uint32_t version = 0;
+  uint64_t count = 0;
+  if (bytes.size() < header_size || bytes.substr(0, 4) != "JBLM") {
+    return std::nullopt;
+  }
+  BloomIndex bloom;
+  bloom.bytes = bytes;
+  std::memcpy(&version, bytes.data() + 4, sizeof(version));
+  std::memcpy(&bloom.file_size, bytes.data() + 8, sizeof(uint64_t));
+  std::memcpy(&count, bytes.data() + 16, sizeof(uint64_t));
+  if (version != 1 || count > (bytes.size() - header_size) / sizeof(Block)) {
+    return std::nullopt;
+  }
+
+  bloom.blocks.resize(count);
+  std::memcpy(bloom.blocks.data(), bytes.data() + header_size,
+              count * sizeof(Block));
+  bloom.words_at = header_size + count * sizeof(Block);
+  uint64_t words = (bytes.size() - std::min(bytes.size(), bloom.words_at)) / 8;
+  for (auto const &block : bloom.blocks) {
+    if (block.begin > block.end || block.end > bloom.file_size ||
+        block.words == 0 || block.first_word > words ||
+        block.words > words - block.first_word) {
+      return std::nullopt;
+    }
+  }
+  return bloom;
+}
+
+inline bool BloomIndex::may_contain(size_t b, std::string_view str) const {
+  if (str.size() > max_length) {
+    return true;
+  }
+  uint64_t hash = fnv1a(str);
+  uint64_t step = (hash >> 33) | 1;
+  uint64_t bits = blocks[b].words * 64;
+  for (unsigned i = 0; i < hashes; ++i) {
+    uint64_t bit = (hash + i * step) % bits;
+    uint64_t word;
+    std::memcpy(&word, bytes.data() + words_at + (blocks[b].first_word +
+                                                  bit / 64) * 8,
+                sizeof(word));
+    if (!((word >> (bit % 64)) & 1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline std::vector<std::string_view> find_containing(std::string_view ndjson,
+                                                     BloomIndex const *bloom,
+                                                     std::string_view needle,
+                                                     unsigned jobs) {
+  std::vector<std::pair<size_t, size_t>> candidates;
+  if (bloom) {
+    for (size_t b = 0; b < bloom->blocks.size(); ++b) {
+      if (bloom->may_contain(b, needle)) {
+        candidates.emplace_back(bloom->blocks[b].begin, bloom->blocks[b].end);
+      }
+    }
+  } else {
+    candidates = line_blocks(ndjson, ndjson.size() / (size_t{jobs} * 8));
+  }
+
+  std::vector<std::vector<std::string_view>> parts(candidates.size());
+  run_tasks(candidates.size(), jobs, [&](size_t c) {
+    auto [from, end] = candidates[c];
+    auto block = ndjson.substr(0, end);
+    while (auto line = next_record(block, from)) {
+      bool found = false;
+      each_string(*line, [&](std::string_view str) {
+        found = found || str == needle;
+      });
+      if (found) {
+        parts[c].push_back(*line);
+      }
+    }
+  });
+
+  std::vector<std::string_view> found;
+  for (auto const &part : parts) {
+    found.insert(found.end(), part.begin(), part.end());
+  }
+  return found;
+}
@@ -0,0 +1,2106 @@
+#pragma once
+
+#include "memory.hpp"
+#include "print.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+struct JSONObject;
+struct LazyJSON;
+
+// String values of one document stored once each and referred to by id.
+// Filled by a single parse; safe to read from any thread afterwards.
+struct StringPool {
+  // Longer strings are rarely repeated and are stored in place
+  size_t max_length = 64;
+
+  std::deque<std::string> strings{};
+  std::unordered_map<std::string_view, uint32_t> ids{};
+
+  uint32_t intern(std::string_view str);
+
+  std::string_view get(uint32_t id) const { return strings[id]; }
+};
+
+// A string value kept in a StringPool
+struct JSONInterned {
+  StringPool const *pool;
+  uint32_t id;
+
+  std::string_view view() const { return pool->get(id); }
+
+  void do_print() const;
+};
+
+// A string value decoded in place inside the buffer that was parsed, which
+// must outlive it
+struct JSONSlice {
+  std::string_view text;
+
+  void do_print() const;
+};
+
+using JSONString = std::pmr::string;
+
+// A number that neither int nor double holds exactly, such as a long amount
+// or one beyond the range of double, kept as its significant digits and a
+// power of ten. Only numbers that need it take this slower form.
+struct JSONDecimal {
+  bool negative = false;
+  JSONString digits{}; // without leading or trailing zeros, empty for 0
+  int64_t exponent = 0; // the value is digits * 10^exponent
+
+  // The decimal a scanned number denotes, read without arithmetic
+  static JSONDecimal from(std::string_view text,
+                          std::pmr::memory_resource *memory =
+                              std::pmr::get_default_resource());
+
+  bool operator==(JSONDecimal const &other) const {
+    return negative == other.negative && digits == other.digits &&
+           exponent == other.exponent;
+  }
+
+  // Nearest double; inf or 0 beyond the range of double
+  double to_double() const;
+
+  // Exact text of the value: integers written out in full, other values
+  // laid out by dump_decimal()
+  void dump(std::string &out) const;
+
+  void do_print() const;
+};
+
+// A number kept as its validated text in the parsed buffer, which must
+// outlive it. It is converted on first access, and written back out as the
+// same text, so passing documents through neither rounds nor reformats it.
+struct JSONNumber {
+  explicit JSONNumber(std::string_view text_) : text(text_) {}
+  JSONNumber(JSONNumber const &other);
+  JSONNumber &operator=(JSONNumber const &other);
+
+  std::string_view text;
+
+  // The converted value, an int when it fits. Ints and doubles are cached
+  // in atomics, so documents shared between threads may call it at once:
+  // racing first calls each store the same result. The rare decimals are
+  // read again each time.
+  JSONObject value() const;
+
+  void do_print() const;
+
+  enum Cached : uint8_t { none, as_int, as_double };
+  mutable std::atomic<uint64_t> cache_bits{0}; // the int or double's bits
+  mutable std::atomic<Cached> cached{none};    // set after cache_bits
+};
+
+// Key list shared by objects that have the same keys in the same order,
+// with each key's index into their value arrays. The slots view the strings
+// in keys, so a shape is never copied once built.
+struct JSONShape {
+  JSONShape() = default;
+  JSONShape(JSONShape const &) = delete;
+  JSONShape &operator=(JSONShape const &) = delete;
+
+  // The shape of these keys in this order, null when one of them repeats
+  static std::shared_ptr<const JSONShape>
+  from(std::pmr::vector<JSONString> const &names);
+
+  std::vector<std::string> keys{};
+  std::unordered_map<std::string_view, uint32_t> slots{};
+};
+
+// Shapes learned by earlier parses, kept by a Parser so that the next
+// documents find their key orders here instead of allocating them again.
+// Only the first max_shapes are kept; any others are learned on each parse.
+struct ShapeRegistry {
+  static constexpr size_t max_shapes = 64;
+
+  // The kept shape with exactly these keys, else a new one as from()
+  std::shared_ptr<const JSONShape>
+  learn(std::pmr::vector<JSONString> const &names);
+
+  std::vector<std::shared_ptr<const JSONShape>> shapes{};
+};
+
+// Remembers the shape a lookup site saw last and the slot it resolved to,
+// so repeated lookups of one key over same-shaped records skip the hash
+struct ShapeCache {
+  JSONShape const *shape = nullptr;
+  uint32_t slot = 0;
+};
+
+// An object that keeps its keys in a shared shape and only its values here
+struct JSONRecord {
+  std::shared_ptr<const JSONShape> shape;
+  std::pmr::vector<JSONObject> values;
+
+  JSONObject const *find(std::string_view key) const;
+
+  // Lookup through a cache owned by the call site, such as a
+  // static thread_local ShapeCache
+  JSONObject const *find(std::string_view key, ShapeCache &cache) const;
+
+  void do_print() const;
+};
+
+// An object's members in the order they were written, found through an
+// open-addressing index of 32-bit entry numbers. Iterating walks the entries
+// in place. Small objects are searched linearly and have no index. Keys
+// must not be changed through iterators, which the index would miss.
+struct JSONDict {
+  using key_type = JSONString;
+  using mapped_type = JSONObject;
+  using value_type = std::pair<JSONString, JSONObject>;
+  using iterator = std::pmr::vector<value_type>::iterator;
+  using const_iterator = std::pmr::vector<value_type>::const_iterator;
+
+  // Objects up to this size have no index
+  static constexpr size_t linear_max = 8;
+
+  std::pmr::vector<value_type> entries;
+
+  // 1 + the entry in each used slot, 0 in free ones. Empty while linear,
+  // else a power of two at least twice the capacity of entries, so probes
+  // always reach a free slot.
+  std::pmr::vector<uint32_t> index;
+
+  JSONDict();
+  explicit JSONDict(std::pmr::memory_resource *memory);
+
+  size_t size() const;
+  bool empty() const;
+  size_t capacity() const;
+  void reserve(size_t n);
+
+  iterator begin();
+  iterator end();
+  const_iterator begin() const;
+  const_iterator end() const;
+
+  iterator find(std::string_view key);
+  const_iterator find(std::string_view key) const;
+
+  // Append a member unless the key is present, which keeps the first value
+  std::pair<iterator, bool> try_emplace(JSONString key, JSONObject value);
+
+  void do_print() const;
+
+  // Slot holding key, or the free slot where it belongs
+  size_t slot_of(std::string_view key) const;
+
+  // Size the index for the capacity of entries and fill it again
+  void reindex();
+};
+
+// Strings and containers take their memory from the resource they were
+// parsed with, see ParseOptions::memory
+using JSONDICT = JSONDict;
+using JSONLIST = std::pmr::vector<JSONObject>;
+using JSONINTS = std::pmr::vector<int>;
+using JSONDOUBLES = std::pmr::vector<double>;
+using JSONLAZY = std::shared_ptr<LazyJSON>;
+
+struct JSONObject {
+  std::variant<std::nullptr_t, // none
+               bool,           // true & false
+               int,            // 3
+               double,         // 3,14
+               JSONString,     // "hello"
+               JSONInterned,   // "hello" in a StringPool
+               JSONSlice,      // "hello" in the parsed buffer
+               JSONNumber,     // 3.14 kept as text
+               JSONDecimal,    // 0.10000000000000000001 exactly
+               JSONLIST,       // [true, 3]
+               JSONDICT,       // {"hello": 3}
+               JSONINTS,       // [1, 2] packed
+               JSONDOUBLES,    // [1, 2.5] packed
+               JSONRecord,     // {"hello": 3} with a shared shape
+               JSONLAZY        // [...] left unparsed
+               >
+      inner;
+
+  void do_print() const { printnl(resolved().inner); }
+
+  // The value itself, or the parsed subtree of a lazy node
+  JSONObject const &resolved() const;
+
+  // Replace a lazy node with a private copy of its parsed subtree
+  JSONObject &resolved();
+
+  template <class T> bool is() const {
+    return std::holds_alternative<T>(resolved().inner);
+  }
+
+  template <class T> T const &get() const {
+    return std::get<T>(resolved().inner);
+  }
+
+  template <class T> T &get() { return std::get<T>(resolved().inner); }
+
+  // Elements of an array or members of an object, 0 for scalars
+  size_t size() const;
+
+  // Copy of the i-th array element, boxing those of packed arrays
+  JSONObject at(size_t i) const;
+
+  // Member of an object or record, or nullptr
+  JSONObject const *find(std::string_view key) const;
+
+  // Whether the value is a string, whichever way it is stored
+  bool is_string() const;
+
+  // Text of a string value, however it is stored
+  std::string_view str() const;
+};
+
+// Element counts of every container of a document, found by one scan ahead
+// of the parse, so that lists and dicts are sized once instead of grown
+struct ContainerSizes {
+  static ContainerSizes count(std::string_view json);
+
+  // Elements of the container opening at open, if the scan saw it
+  std::optional<size_t> of(char const *open) const;
+
+  char const *base = nullptr;
+  std::vector<std::pair<size_t, size_t>> sizes{}; // offset, element count
+};
+
+struct ParseOptions {
+  // Keep nested containers as raw spans, parsed on first access
+  bool lazy = false;
+
+  // Store short string values once in this pool; keys are never interned
+  StringPool *intern = nullptr;
+
+  // Decode string values over their raw text and keep them as slices. Set
+  // by parse_insitu(), or by callers that know json views writable memory.
+  bool insitu = false;
+
+  // Keep numbers as their text, which must outlive the document, instead
+  // of converting them while parsing
+  bool raw_numbers = false;
+
+  // Where the strings and containers of the document are allocated. The
+  // resource must outlive the document; lazy subtrees, which may be parsed
+  // from any thread later, use the default resource instead.
+  std::pmr::memory_resource *memory = std::pmr::get_default_resource();
+
+  // Counted sizes of the containers of json, used to reserve them exactly.
+  // Not passed on to lazy subtrees.
+  ContainerSizes const *sizes = nullptr;
+
+  // Where record shapes are looked up before new ones are learned. Like
+  // the string pool, it is only used by this parse and not by lazy subtrees.
+  ShapeRegistry *shapes = nullptr;
+};
+
+// A container kept as its raw text until first touched. The text is a view
+// into the parsed buffer, which must outlive the node.
+struct LazyJSON {
+  LazyJSON(std::string_view raw_, ParseOptions opts_)
+      : raw(raw_), opts(opts_), once(), value{nullptr} {}
+
+  // Parse the subtree on first call; safe to race from several threads
+  JSONObject const &get();
+
+  std::string_view raw;
+  ParseOptions opts;
+  std::once_flag once;
+  JSONObject value;
+};
+
+// Parses one document after another, such as the messages of a loop, out
+// of an arena that is reset instead of freed between them. Once the arena
+// has grown to fit the usual message, parsing allocates nothing more from
+// the heap. Each document is only valid until the next call.
+struct Parser {
+  explicit Parser(ParseOptions opts_ = {}) : opts(opts_) {
+    opts.memory = &arena;
+    opts.shapes = &shapes;
+  }
+
+  std::pair<JSONObject const &, size_t> parse(std::string_view json);
+
+  Arena arena{};
+  ShapeRegistry shapes{};
+  ParseOptions opts;
+  JSONObject doc{nullptr};
+};
+
+char unescaped_char(char c);
+
+// Decode the \uXXXX escape at the start of text, or a surrogate pair of
+// two, passing its UTF-8 bytes to put. Returns the bytes of text used, 0 if
+// it is not such an escape. Lone surrogates become U+FFFD.
+template <class F> size_t unescape_unicode(std::string_view text, F &&put);
+
+template <class T> std::optional<T> try_parse_num(std::string_view str);
+
+// Value of a scanned number: an int when it fits, else a double when that
+// holds it exactly, else a decimal allocated from memory
+JSONObject to_number(std::string_view text,
+                     std::pmr::memory_resource *memory =
+                         std::pmr::get_default_resource());
+
+// Call put with each significant digit of a scanned number, trailing zeros
+// left out, and return whether it is negative and the power of ten of its
+// last digit. Stops with nullopt as soon as put returns false.
+template <class F>
+std::optional<std::pair<bool, int64_t>> decimal_digits(std::string_view text,
+                                                       F &&put);
+
+// Append the number digits * 10^exponent as ECMAScript lays numbers out:
+// plain from 1e-6 up to 21 integer digits, else with one digit before the
+// point and an exponent. Zero is written without a sign.
+void dump_decimal(bool negative, std::string_view digits, int64_t exponent,
+                  std::string &out);
+
+// Append a finite double as ECMAScript's Number::toString writes it
+void dump_ecmascript(double num, std::string &out);
+
+// Length of the number at the start of json, 0 if it does not start with
+// one. Like the grammar's optional parts, a fraction or exponent without
+// digits is left out of the number.
+size_t scan_number(std::string_view json);
+
+std::pair<JSONObject, size_t> parse(std::string_view json,
+                                    ParseOptions const &opts = {});
+
+// Parse a writable buffer in place: string values are decoded inside it and
+// kept as slices of it, so it must outlive the result
+std::pair<JSONObject, size_t> parse_insitu(char *json, size_t size,
+                                           ParseOptions opts = {});
+
+// Parse the values of json one after another, whether separated by
+// whitespace, simply concatenated, or framed by RFC 7464 record separators,
+// and pass each to visit. A bad value framed by separators is skipped up to
+// the next one; any other bad value ends the stream. Returns the number of
+// bytes consumed.
+template <class F>
+size_t parse_stream(std::string_view json, ParseOptions const &opts,
+                    F &&visit);
+
+// Split an RFC 6901 JSON Pointer into unescaped reference tokens
+std::optional<std::vector<std::string>> split_pointer(std::string_view pointer);
+
+// Split a JSON Pointer, or a dotted field path such as furi.key or .furi.key
+std::optional<std::vector<std::string>> split_path(std::string_view path);
+
+// Raw text of the value at a path, found by skipping every other member
+// without decoding it
+std::optional<std::string_view> project(std::string_view json,
+                                        std::vector<std::string> const &tokens);
+
+// Resolve a JSON Pointer such as /fufu/2, or nullptr. Elements of packed
+// arrays have no node of their own, so they are boxed into scratch.
+JSONObject const *find_pointer(JSONObject const &obj, std::string_view pointer,
+                               JSONObject &scratch);
+
+// Store a list made only of numbers as a packed vector
+JSONObject pack_numbers(JSONLIST list);
+
+// Parse an object as a record whose keys match shape in order, or learn a
+// new shape when shape is null. Eats nothing if the keys do not match.
+std::pair<JSONObject, size_t>
+parse_record(std::string_view json,
+             std::shared_ptr<const JSONShape> const &shape,
+             ParseOptions const &opts);
+
+// Length of the value at the head of json, checked for balance only
+size_t skip_value(std::string_view json);
+
+// Split the array or object at the head of json into its member spans
+size_t split_members(std::string_view json,
+                     std::vector<std::string_view> &members);
+
+// Parse an object member span of the form "key": value
+std::optional<std::pair<JSONString, JSONObject>>
+parse_member(std::string_view member, unsigned jobs,
+             ParseOptions const &opts = {});
+
+// Build the members of a wide array or object on several threads. The
+// values are parsed with opts, which the threads share, so it must not hold
+// a string pool, a shape registry or an arena. The objects of an array
+// become the same records and dicts as in a serial parse.
+std::pair<JSONObject, size_t> parse_parallel(std::string_view json,
+                                             unsigned jobs,
+                                             ParseOptions const &opts = {});
+
+// Run task(0) to task(count - 1) on up to jobs threads that each claim the
+// next index as they finish, so uneven tasks balance out
+template <class F> void run_tasks(size_t count, unsigned jobs, F &&task);
+
+// Records of a JSON array, or else the non-blank lines of NDJSON
+std::vector<std::string_view> record_spans(std::string_view json);
+
+// The next non-blank line of NDJSON at or after from, moving from past it
+std::optional<std::string_view> next_record(std::string_view ndjson,
+                                            size_t &from);
+
+inline JSONObject const &JSONObject::resolved() const {
+  if (auto lazy = std::get_if<JSONLAZY>(&inner)) {
+    return (*lazy)->get();
+  }
+  return *this;
+}
+
+inline JSONObject &JSONObject::resolved() {
+  if (auto lazy = std::get_if<JSONLAZY>(&inner)) {
+    JSONObject value = (*lazy)->get();
+    inner = std::move(value.inner);
+  }
+  return *this;
+}
+
+inline size_t JSONObject::size() const {
+  return std::visit(
+      [](auto const &val) -> size_t {
+        using T = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<T, JSONLIST> ||
+                      std::is_same_v<T, JSONDICT> ||
+                      std::is_same_v<T, JSONINTS> ||
+                      std::is_same_v<T, JSONDOUBLES>) {
+          return val.size();
+        } else if constexpr (std::is_same_v<T, JSONRecord>) {
+          return val.values.size();
+        } else if constexpr (std::is_same_v<T, JSONLAZY>) {
+          return val->get().size();
+        } else {
+          return 0;
+        }
+      },
+      inner);
+}
+
+inline JSONObject const *JSONObject::find(std::string_view key) const {
+  JSONObject const &obj = resolved();
+  if (auto rec = std::get_if<JSONRecord>(&obj.inner)) {
+    return rec->find(key);
+  }
+  if (auto dict = std::get_if<JSONDICT>(&obj.inner)) {
+    auto it = dict->find(key);
+    return it != dict->end() ? &it->second : nullptr;
+  }
+  return nullptr;
+}
+
+inline JSONObject const *JSONRecord::find(std::string_view key) const {
+  auto it = shape->slots.find(key);
+  return it != shape->slots.end() ? &values[it->second] : nullptr;
+}
+
+inline JSONObject const *JSONRecord::find(std::string_view key,
+                                          ShapeCache &cache) const {
+  if (cache.shape == shape.get() && shape->keys[cache.slot] == key) {
+    return &values[cache.slot];
+  }
+  auto it = shape->slots.find(key);
+  if (it == shape->slots.end()) {
+    return nullptr;
+  }
+  cache = {shape.get(), it->second};
+  return &values[it->second];
+}
+
+inline void JSONRecord::do_print() const {
+  std::cout << "{";
+  for (size_t k = 0; k < values.size(); ++k) {
+    if (k != 0) {
+      std::cout << ", ";
+    }
+    printnl(shape->keys[k]);
+    std::cout << ": ";
+    printnl(values[k]);
+  }
+  std::cout << "}";
+}
+
+inline JSONDict::JSONDict() : entries(), index() {}
+
+inline JSONDict::JSONDict(std::pmr::memory_resource *memory)
+    : entries(memory), index(memory) {}
+
+inline size_t JSONDict::size() const { return entries.size(); }
+
+inline bool JSONDict::empty() const { return entries.empty(); }
+
+inline size_t JSONDict::capacity() const { return entries.capacity(); }
+
+inline void JSONDict::reserve(size_t n) {
+  size_t capacity = entries.capacity();
+  entries.reserve(n);
+  if (entries.capacity() != capacity && entries.capacity() > linear_max) {
+    reindex();
+  }
+}
+
+inline JSONDict::iterator JSONDict::begin() { return entries.begin(); }
+
+inline JSONDict::iterator JSONDict::end() { return entries.end(); }
+
+inline JSONDict::const_iterator JSONDict::begin() const {
+  return entries.begin();
+}
+
+inline JSONDict::const_iterator JSONDict::end() const { return entries.end(); }
+
+inline JSONDict::iterator JSONDict::find(std::string_view key) {
+  auto it = std::as_const(*this).find(key);
+  return entries.begin() + (it - entries.cbegin());
+}
+
+inline JSONDict::const_iterator JSONDict::find(std::string_view key) const {
+  if (index.empty()) {
+    return std::find_if(
+        entries.begin(), entries.end(),
+        [key](value_type const &entry) { return entry.first == key; });
+  }
+  uint32_t entry = index[slot_of(key)];
+  return entry != 0 ? entries.begin() + (entry - 1) : entries.end();
+}
+
+inline std::pair<JSONDict::iterator, bool>
+JSONDict::try_emplace(JSONString key, JSONObject value) {
+  // With room left the index takes the new entry in the slot found by the
+  // lookup, so building an object probes once per member
+  if (!index.empty() && entries.size() < entries.capacity()) {
+    size_t slot = slot_of(key);
+    if (index[slot] != 0) {
+      return {entries.begin() + (index[slot] - 1), false};
+    }
+    index[slot] = static_cast<uint32_t>(entries.size() + 1);
+    entries.emplace_back(std::move(key), std::move(value));
+    return {std::prev(entries.end()), true};
+  }
+
+  if (auto it = find(key); it != entries.end()) {
+    return {it, false};
+  }
+  entries.emplace_back(std::move(key), std::move(value));
+  if (entries.size() > linear_max) {
+    reindex();
+  }
+  return {std::prev(entries.end()), true};
+}
+
+inline size_t JSONDict::slot_of(std::string_view key) const {
+  size_t mask = index.size() - 1;
+  for (size_t k = std::hash<std::string_view>{}(key) & mask;;
+       k = (k + 1) & mask) {
+    if (index[k] == 0 || entries[index[k] - 1].first == key) {
+      return k;
+    }
+  }
+}
+
+inline void JSONDict::reindex() {
+  size_t slots = 1;
+  while (slots < 2 * entries.capacity()) {
+    slots *= 2;
+  }
+  index.assign(slots, 0);
+  for (size_t k = 0; k < entries.size(); ++k) {
+    index[slot_of(entries[k].first)] = static_cast<uint32_t>(k + 1);
+  }
+}
+
+inline void JSONDict::do_print() const {
+  std::cout << "{";
+  for (size_t k = 0; k < entries.size(); ++k) {
+    if (k != 0) {
+      std::cout << ", ";
+    }
+    printnl(entries[k].first);
+    std::cout << ": ";
+    printnl(entries[k].second);
+  }
+  std::cout << "}";
+}
+
+inline bool JSONObject::is_string() const {
+  return is<JSONString>() || is<JSONInterned>() || is<JSONSlice>();
+}
+
+inline std::string_view JSONObject::str() const {
+  JSONObject const &obj = resolved();
+  if (auto interned = std::get_if<JSONInterned>(&obj.inner)) {
+    return interned->view();
+  }
+  if (auto slice = std::get_if<JSONSlice>(&obj.inner)) {
+    return slice->text;
+  }
+  return obj.get<JSONString>();
+}
+
+inline uint32_t StringPool::intern(std::string_view str) {
+  if (auto it = ids.find(str); it != ids.end()) {
+    return it->second;
+  }
+  auto id = static_cast<uint32_t>(strings.size());
+  strings.emplace_back(str);
+  ids.emplace(strings.back(), id);
+  return id;
+}
+
+inline void JSONInterned::do_print() const { printnl(view()); }
+
+inline void JSONSlice::do_print() const { printnl(text); }
+
+inline JSONNumber::JSONNumber(JSONNumber const &other)
+    : text(other.text), cache_bits(other.cache_bits.load()),
+      cached(other.cached.load()) {}
+
+inline JSONNumber &JSONNumber::operator=(JSONNumber const &other) {
+  text = other.text;
+  cached = none;
+  cache_bits = other.cache_bits.load();
+  cached = other.cached.load();
+  return *this;
+}
+
+inline JSONObject JSONNumber::value() const {
+  Cached kind = cached.load(std::memory_order_acquire);
+  if (kind != none) {
+    uint64_t bits = cache_bits.load(std::memory_order_relaxed);
+    if (kind == as_int) {
+      return JSONObject{static_cast<int>(static_cast<int64_t>(bits))};
+    }
+    double num;
+    std::memcpy(&num, &bits, sizeof(num));
+    return JSONObject{num};
+  }
+  JSONObject num = to_number(text);
+  if (auto n = std::get_if<int>(&num.inner)) {
+    cache_bits.store(static_cast<uint64_t>(int64_t{*n}),
+                     std::memory_order_relaxed);
+    cached.store(as_int, std::memory_order_release);
+  } else if (auto d = std::get_if<double>(&num.inner)) {
+    uint64_t bits;
+    std::memcpy(&bits, &*d, sizeof(bits));
+    cache_bits.store(bits, std::memory_order_relaxed);
+    cached.store(as_double, std::memory_order_release);
+  }
+  return num;
+}
+
+inline void JSONNumber::do_print() const { std::cout << text; }
+
+inline JSONObject JSONObject::at(size_t i) const {
+  JSONObject const &obj = resolved();
+  if (auto ints = std::get_if<JSONINTS>(&obj.inner)) {
+    return JSONObject{(*ints)[i]};
+  }
+  if (auto doubles = std::get_if<JSONDOUBLES>(&obj.inner)) {
+    return JSONObject{(*doubles)[i]};
+  }
+  return obj.get<JSONLIST>()[i];
+}
+
+inline JSONObject const &LazyJSON::get() {
+  std::call_once(once, [this] { value = parse(raw, opts).first; });
+  return value;
+}
+
+inline std::pair<JSONObject, size_t> parse(std::string_view json,
+                                           ParseOptions const &opts) {
+  // Parse empty
+  if (json.empty()) {
+    return {JSONObject{std::nullptr_t{}}, 0};
+  }
+
+  // Exclude leading escape characters
+  if (size_t off = json.find_first_not_of(" \n\r\t\v\f\0");
+      off != 0 && off != json.npos) {
+    auto [obj, eaten] = parse(json.substr(off), opts);
+    return {std::move(obj), eaten == 0 ? 0 : eaten + off};
+  }
+
+  if (json.size() >= 4) {
+    // Parse null
+    if (json.substr(0, 4) == "null") {
+      return {JSONObject{std::nullptr_t{}}, 4};
+    }
+
+    // Parse bool
+    if (json.substr(0, 4) == "true") {
+      return {JSONObject{true}, 4};
+    }
+  }
+
+  if (json.size() >= 5) {
+    if (json.substr(0, 5) == "false") {
+      return {JSONObject{false}, 5};
+    }
+  }
+
+  // Parse int & double
+  if (size_t length = scan_number(json); length != 0) {
+    std::string_view str = json.substr(0, length);
+    if (opts.raw_numbers) {
+      return {JSONObject{JSONNumber{str}}, length};
+    }
+
+    return {to_number(str, opts.memory), length};
+  }
+
+  // Parse string. In place, the text is decoded over itself, which works
+  // because no escape decodes to more bytes than it takes up, \uXXXX
+  // included.
+  if (json[0] == '"') {
+    char *const begin = opts.insitu ? const_cast<char *>(json.data()) + 1
+                                    : nullptr;
+    char *end = begin;
+    JSONString str(opts.memory);
+    auto put = [&end, &str](char ch) {
+      if (end) {
+        *end++ = ch;
+      } else {
+        str += ch;
+      }
+    };
+    enum { Raw, Esc } phase = Raw;
+
+    size_t i = 1;
+    for (; i < json.size(); ++i) {
+      char ch = json[i];
+      if (phase == Raw) {
+        if (ch == '\\') {
+          phase = Esc;
+          continue;
+        } else if (ch == '"') {
+          i++;
+          break;
+        } else {
+          put(ch);
+        }
+      }
+
+      if (phase == Esc) {
+        phase = Raw;
+        if (ch == 'u') {
+          // The escape starts at the backslash before this byte
+          if (size_t used = unescape_unicode(json.substr(i - 1), put)) {
+            i += used - 2;
+            continue;
+          }
+        }
+        put(unescaped_char(ch));
+      }
+    }
+
+    if (begin) {
+      std::string_view text(begin, static_cast<size_t>(end - begin));
+      if (!opts.intern || text.size() > opts.intern->max_length) {
+        return {JSONObject{JSONSlice{text}}, i};
+      }
+      str = text;
+    }
+
+    if (opts.intern && str.size() <= opts.intern->max_length) {
+      uint32_t id = opts.intern->intern(str);
+      return {JSONObject{JSONInterned{opts.intern, id}}, i};
+    }
+    return {JSONObject{std::move(str)}, i};
+  }
+
+  auto skip_whitespace = [&json](size_t &i) {
+    while (i < json.size() &&
+           std::isspace(static_cast<unsigned char>(json[i]))) {
+      ++i;
+    }
+  };
+
+  // Nested containers of a lazy parse are only checked for balance
+  auto parse_child = [&json,
+                      &opts](size_t i) -> std::pair<JSONObject, size_t> {
+    size_t off = json.find_first_not_of(" \n\r\t\v\f", i);
+    if (opts.lazy && off != json.npos &&
+        (json[off] == '[' || json[off] == '{')) {
+      size_t eaten = skip_value(json.substr(i));
+      if (eaten == 0) {
+        return {JSONObject{std::nullptr_t{}}, 0};
+      }
+      // The pool is only filled during this parse, so subtrees parsed
+      // later from other threads keep their strings in place
+      ParseOptions lazy_opts = opts;
+      lazy_opts.intern = nullptr;
+      lazy_opts.shapes = nullptr;
+      lazy_opts.insitu = false;
+      lazy_opts.memory = std::pmr::get_default_resource();
+      lazy_opts.sizes = nullptr;
+      std::string_view raw = json.substr(off, i + eaten - off);
+      return {JSONObject{std::make_shared<LazyJSON>(raw, lazy_opts)}, eaten};
+    }
+    return parse(json.substr(i), opts);
+  };
+
+  // Parse list
+  if (json[0] == '[') {
+    // Numbers go straight into packed vectors until some element is not a
+    // number. Ints that share the vector with doubles are remembered by
+    // position (the leading run just by its length), so a list turning mixed
+    // boxes them back as ints without parsing anything twice, which in place
+    // would decode its strings a second time.
+    JSONINTS ints(opts.memory);
+    JSONDOUBLES doubles(opts.memory);
+    JSONLIST res(opts.memory);
+    bool packed = true;
+    size_t leading_ints = 0;
+    std::pmr::vector<size_t> ints_at(opts.memory);
+
+    // Objects become records sharing the key order of the first one for as
+    // long as each of the following ones matches it. Not when parsing in
+    // place, where an object that fails to match and is parsed again would
+    // find its strings already decoded.
+    std::shared_ptr<const JSONShape> shape;
+    bool shaped = !opts.lazy && !opts.insitu;
+
+    // With counted sizes, whichever vector the elements go to is reserved
+    // for all of them when it takes the first
+    std::optional<size_t> size;
+    if (opts.sizes) {
+      size = opts.sizes->of(json.data());
+    }
+
+    size_t i = 1;
+    skip_whitespace(i);
+    for (; i < json.size();) {
+      if (json[i] == ']') {
+        i += 1;
+        break;
+      }
+      std::pair<JSONObject, size_t> child{JSONObject{nullptr}, 0};
+      if (size_t off = json.find_first_not_of(" \n\r\t\v\f", i);
+          shaped && off != json.npos && json[off] == '{') {
+        child = parse_record(json.substr(i), shape, opts);
+        if (child.second == 0) {
+          shaped = false;
+        } else if (!shape) {
+          shape = child.first.get<JSONRecord>().shape;
+        }
+      }
+      if (child.second == 0) {
+        child = parse_child(i);
+      }
+      auto &[obj, eaten] = child;
+      if (eaten == 0) {
+        i = 0;
+        break;
+      }
+      if (!packed) {
+        if (size && res.empty()) {
+          res.reserve(*size);
+        }
+        res.push_back(std::move(obj));
+      } else if (auto n = std::get_if<int>(&obj.inner)) {
+        if (doubles.empty()) {
+          if (size && ints.empty()) {
+            ints.reserve(*size);
+          }
+          ints.push_back(*n);
+        } else {
+          ints_at.push_back(doubles.size());
+          doubles.push_back(*n);
+        }
+      } else if (auto d = std::get_if<double>(&obj.inner)) {
+        if (size && doubles.empty()) {
+          doubles.reserve(*size);
+        }
+        if (doubles.empty()) {
+          leading_ints = ints.size();
+        }
+        doubles.insert(doubles.end(), ints.begin(), ints.end());
+        ints.clear();
+        doubles.push_back(*d);
+      } else if (doubles.empty()) {
+        packed = false;
+        res.reserve(size.value_or(ints.size() + 1));
+        for (int num : ints) {
+          res.push_back(JSONObject{num});
+        }
+        ints.clear();
+        ints.shrink_to_fit();
+        res.push_back(std::move(obj));
+      } else {
+        packed = false;
+        res.reserve(size.value_or(doubles.size() + 1));
+        auto next_int = ints_at.begin();
+        for (size_t k = 0; k < doubles.size(); ++k) {
+          bool was_int = k < leading_ints;
+          if (!was_int && next_int != ints_at.end() && *next_int == k) {
+            was_int = true;
+            ++next_int;
+          }
+          if (was_int) {
+            res.push_back(JSONObject{static_cast<int>(doubles[k])});
+          } else {
+            res.push_back(JSONObject{doubles[k]});
+          }
+        }
+        doubles.clear();
+        doubles.shrink_to_fit();
+        res.push_back(std::move(obj));
+      }
+      i += eaten;
+
+      skip_whitespace(i);
+      if (json[i] == ',') {
+        i += 1;
+      }
+      skip_whitespace(i);
+    }
+    if (packed && !doubles.empty()) {
+      return {JSONObject{std::move(doubles)}, i};
+    }
+    if (packed && !ints.empty()) {
+      return {JSONObject{std::move(ints)}, i};
+    }
+    return {JSONObject{std::move(res)}, i};
+  }
+
+  ParseOptions key_opts = opts;
+  key_opts.intern = nullptr;
+  key_opts.insitu = false;
+
+  // Parse dict
+  if (json[0] == '{') {
+    JSONDICT res(opts.memory);
+    if (opts.sizes) {
+      if (auto size = opts.sizes->of(json.data())) {
+        res.reserve(*size);
+      }
+    }
+    size_t i = 1;
+    skip_whitespace(i);
+    for (; i < json.size();) {
+      if (json[i] == '}') {
+        i += 1;
+        break;
+      }
+      auto [keyobj, keyeaten] = parse(json.substr(i), key_opts);
+      if (keyeaten == 0) {
+        i = 0;
+        break;
+      }
+      i += keyeaten;
+      if (!std::holds_alternative<JSONString>(keyobj.inner)) {
+        i = 0;
+        break;
+      }
+
+      skip_whitespace(i);
+      if (json[i] == ':') {
+        i += 1;
+      }
+      skip_whitespace(i);
+
+      JSONString key = std::move(std::get<JSONString>(keyobj.inner));
+      auto [valobj, valeaten] = parse_child(i);
+      if (valeaten == 0) {
+        i = 0;
+        break;
+      }
+      i += valeaten;
+      res.try_emplace(std::move(key), std::move(valobj));
+
+      skip_whitespace(i);
+      if (json[i] == ',') {
+        i += 1;
+      }
+      skip_whitespace(i);
+    }
+    return {JSONObject{std::move(res)}, i};
+  }
+
+  return {JSONObject{std::nullptr_t{}}, 0};
+}
+
+inline std::pair<JSONObject, size_t> parse_insitu(char *json, size_t size,
+                                                  ParseOptions opts) {
+  opts.insitu = true;
+  return parse(std::string_view(json, size), opts);
+}
+
+template <class F>
+size_t parse_stream(std::string_view json, ParseOptions const &opts,
+                    F &&visit) {
+  constexpr char record_separator = '\x1e';
+  size_t pos = 0;
+  for (;;) {
+    pos = std::min(json.find_first_not_of(" \n\r\t\v\f\x1e", pos),
+                   json.size());
+    if (pos == json.size()) {
+      return pos;
+    }
+    auto [value, eaten] = parse(json.substr(pos), opts);
+    if (eaten != 0) {
+      visit(value);
+      pos += eaten;
+      continue;
+    }
+    // RFC 7464 lets whitespace follow the separator before the value
+    size_t before =
+        pos == 0 ? json.npos : json.find_last_not_of(" \n\r\t\v\f", pos - 1);
+    bool framed = before != json.npos && json[before] == record_separator;
+    size_t next = json.find(record_separator, pos);
+    if (!framed || next == json.npos) {
+      return pos;
+    }
+    pos = next;
+  }
+}
+
+inline std::optional<std::vector<std::string>>
+split_pointer(std::string_view pointer) {
+  std::vector<std::string> tokens;
+  while (!pointer.empty()) {
+    if (pointer[0] != '/') {
+      return std::nullopt;
+    }
+    pointer.remove_prefix(1);
+    size_t end = std::min(pointer.find('/'), pointer.size());
+
+    // Undo the ~1 and ~0 escapes of / and ~
+    std::string &token = tokens.emplace_back();
+    for (size_t i = 0; i < end; ++i) {
+      if (pointer[i] == '~' && i + 1 < end &&
+          (pointer[i + 1] == '0' || pointer[i + 1] == '1')) {
+        token += pointer[++i] == '0' ? '~' : '/';
+      } else {
+        token += pointer[i];
+      }
+    }
+    pointer.remove_prefix(end);
+  }
+  return tokens;
+}
+
+inline std::optional<std::vector<std::string>>
+split_path(std::string_view path) {
+  if (!path.empty() && path[0] == '.') {
+    path.remove_prefix(1);
+  }
+  if (path.empty() || path[0] == '/') {
+    return split_pointer(path);
+  }
+
+  std::vector<std::string> tokens;
+  for (size_t begin = 0; begin <= path.size();) {
+    size_t end = std::min(path.find('.', begin), path.size());
+    tokens.emplace_back(path.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return tokens;
+}
+
+inline std::optional<std::string_view>
+project(std::string_view json, std::vector<std::string> const &tokens) {
+  auto skip_whitespace = [&json](size_t &i) {
+    while (i < json.size() &&
+           std::isspace(static_cast<unsigned char>(json[i]))) {
+      ++i;
+    }
+  };
+
+  for (auto const &token : tokens) {
+    size_t i = 0;
+    skip_whitespace(i);
+    if (i >= json.size() || (json[i] != '{' && json[i] != '[')) {
+      return std::nullopt;
+    }
+
+    bool is_dict = json[i] == '{';
+    std::optional<size_t> index;
+    if (!is_dict) {
+      index = try_parse_num<size_t>(token);
+      if (!index.has_value()) {
+        return std::nullopt;
+      }
+    }
+
+    i += 1;
+    for (size_t k = 0;; ++k) {
+      skip_whitespace(i);
+      if (i >= json.size() || json[i] == '}' || json[i] == ']') {
+        return std::nullopt;
+      }
+
+      bool match = !is_dict && k == *index;
+      if (is_dict) {
+        size_t keyeaten = skip_value(json.substr(i));
+        if (keyeaten < 2) {
+          return std::nullopt;
+        }
+        // Only keys with escapes need decoding to compare
+        std::string_view key = json.substr(i + 1, keyeaten - 2);
+        match = key.find('\\') == key.npos
+                    ? key == token
+                    : parse(json.substr(i, keyeaten)).first.str() == token;
+        i += keyeaten;
+        skip_whitespace(i);
+        if (i >= json.size() || json[i] != ':') {
+          return std::nullopt;
+        }
+        i += 1;
+      }
+
+      size_t eaten = skip_value(json.substr(i));
+      if (eaten == 0) {
+        return std::nullopt;
+      }
+      if (match) {
+        json = json.substr(i, eaten);
+        break;
+      }
+      i += eaten;
+      skip_whitespace(i);
+      if (i < json.size() && json[i] == ',') {
+        i += 1;
+      }
+    }
+  }
+
+  size_t off = json.find_first_not_of(" \n\r\t\v\f");
+  return off == json.npos ? json : json.substr(off);
+}
+
+inline JSONObject const *find_pointer(JSONObject const &obj,
+                                      std::string_view pointer,
+                                      JSONObject &scratch) {
+  auto tokens = split_pointer(pointer);
+  if (!tokens.has_value()) {
+    return nullptr;
+  }
+
+  JSONObject const *cur = &obj.resolved();
+  for (auto const &token : *tokens) {
+    if (auto dict = std::get_if<JSONDICT>(&cur->inner)) {
+      auto it = dict->find(token);
+      if (it == dict->end()) {
+        return nullptr;
+      }
+      cur = &it->second.resolved();
+    } else if (auto list = std::get_if<JSONLIST>(&cur->inner)) {
+      auto index = try_parse_num<size_t>(token);
+      if (!index.has_value() || *index >= list->size()) {
+        return nullptr;
+      }
+      cur = &(*list)[*index].resolved();
+    } else if (std::holds_alternative<JSONRecord>(cur->inner)) {
+      cur = cur->find(token);
+      if (!cur) {
+        return nullptr;
+      }
+      cur = &cur->resolved();
+    } else if (cur->size() != 0 &&
+               !std::holds_alternative<JSONDICT>(cur->inner)) {
+      auto index = try_parse_num<size_t>(token);
+      if (!index.has_value() || *index >= cur->size()) {
+        return nullptr;
+      }
+      scratch = cur->at(*index);
+      cur = &scratch;
+    } else {
+      return nullptr;
+    }
+  }
+  return cur;
+}
+
+inline std::pair<JSONObject, size_t>
+parse_record(std::string_view json,
+             std::shared_ptr<const JSONShape> const &shape,
+             ParseOptions const &opts) {
+  size_t i = json.find_first_not_of(" \n\r\t\v\f");
+  if (i == json.npos || json[i] != '{') {
+    return {JSONObject{nullptr}, 0};
+  }
+
+  auto skip_whitespace = [&json](size_t &i) {
+    while (i < json.size() &&
+           std::isspace(static_cast<unsigned char>(json[i]))) {
+      ++i;
+    }
+  };
+
+  // Keys of a shape being learned, in the document's memory until they are
+  // matched against the registry or copied into a new shape
+  std::pmr::vector<JSONString> names(opts.memory);
+  JSONRecord rec{shape, std::pmr::vector<JSONObject>(opts.memory)};
+  if (shape) {
+    rec.values.reserve(shape->keys.size());
+  }
+
+  ParseOptions key_opts = opts;
+  key_opts.intern = nullptr;
+  key_opts.insitu = false;
+
+  i += 1;
+  skip_whitespace(i);
+  while (i < json.size() && json[i] != '}') {
+    auto [keyobj, keyeaten] = parse(json.substr(i), key_opts);
+    if (keyeaten == 0 || !std::holds_alternative<JSONString>(keyobj.inner)) {
+      return {JSONObject{nullptr}, 0};
+    }
+    auto &key = std::get<JSONString>(keyobj.inner);
+
+    size_t k = rec.values.size();
+    if (!shape) {
+      names.push_back(std::move(key));
+    } else if (k >= shape->keys.size() ||
+               shape->keys[k] != std::string_view(key)) {
+      return {JSONObject{nullptr}, 0};
+    }
+    i += keyeaten;
+
+    skip_whitespace(i);
+    if (i < json.size() && json[i] == ':') {
+      i += 1;
+    }
+    auto [valobj, valeaten] = parse(json.substr(i), opts);
+    if (valeaten == 0) {
+      return {JSONObject{nullptr}, 0};
+    }
+    rec.values.push_back(std::move(valobj));
+    i += valeaten;
+
+    skip_whitespace(i);
+    if (i < json.size() && json[i] == ',') {
+      i += 1;
+    }
+    skip_whitespace(i);
+  }
+
+  if (i >= json.size()) {
+    return {JSONObject{nullptr}, 0};
+  }
+  if (!shape) {
+    // Duplicate keys are left to the dict, which keeps the first one
+    rec.shape = opts.shapes ? opts.shapes->learn(names)
+                            : JSONShape::from(names);
+    if (!rec.shape) {
+      return {JSONObject{nullptr}, 0};
+    }
+  }
+  if (rec.values.size() != rec.shape->keys.size()) {
+    return {JSONObject{nullptr}, 0};
+  }
+  return {JSONObject{std::move(rec)}, i + 1};
+}
+
+inline std::shared_ptr<const JSONShape>
+JSONShape::from(std::pmr::vector<JSONString> const &names) {
+  auto shape = std::make_shared<JSONShape>();
+  shape->keys.assign(names.begin(), names.end());
+  shape->slots.reserve(names.size());
+  for (size_t k = 0; k < shape->keys.size(); ++k) {
+    if (!shape->slots.try_emplace(shape->keys[k], static_cast<uint32_t>(k))
+             .second) {
+      return nullptr;
+    }
+  }
+  return shape;
+}
+
+inline std::shared_ptr<const JSONShape>
+ShapeRegistry::learn(std::pmr::vector<JSONString> const &names) {
+  for (auto const &shape : shapes) {
+    if (std::equal(shape->keys.begin(), shape->keys.end(), names.begin(),
+                   names.end(), [](std::string const &a, JSONString const &b) {
+                     return std::string_view(a) == b;
+                   })) {
+      return shape;
+    }
+  }
+  auto shape = JSONShape::from(names);
+  if (shape && shapes.size() < max_shapes) {
+    shapes.push_back(shape);
+  }
+  return shape;
+}
+
+inline JSONObject pack_numbers(JSONLIST list) {
+  bool any_double = false;
+  for (auto const &member : list) {
+    if (std::holds_alternative<double>(member.inner)) {
+      any_double = true;
+    } else if (!std::holds_alternative<int>(member.inner)) {
+      return JSONObject{std::move(list)};
+    }
+  }
+  if (list.empty()) {
+    return JSONObject{std::move(list)};
+  }
+
+  if (!any_double) {
+    JSONINTS ints;
+    ints.reserve(list.size());
+    for (auto const &member : list) {
+      ints.push_back(std::get<int>(member.inner));
+    }
+    return JSONObject{std::move(ints)};
+  }
+
+  JSONDOUBLES doubles;
+  doubles.reserve(list.size());
+  for (auto const &member : list) {
+    if (auto n = std::get_if<int>(&member.inner)) {
+      doubles.push_back(*n);
+    } else {
+      doubles.push_back(std::get<double>(member.inner));
+    }
+  }
+  return JSONObject{std::move(doubles)};
+}
+
+inline size_t skip_value(std::string_view json) {
+  size_t i = json.find_first_not_of(" \n\r\t\v\f");
+  if (i == json.npos) {
+    return 0;
+  }
+
+  size_t start = i;
+  std::vector<char> closers;
+  bool in_str = false;
+  for (; i < json.size(); ++i) {
+    char ch = json[i];
+    if (in_str) {
+      if (ch == '\\') {
+        ++i;
+      } else if (ch == '"') {
+        in_str = false;
+        if (closers.empty()) {
+          return i + 1;
+        }
+      }
+      continue;
+    }
+
+    switch (ch) {
+    case '"':
+      if (closers.empty() && i != start) {
+        return 0;
+      }
+      in_str = true;
+      break;
+    case '[':
+      closers.push_back(']');
+      break;
+    case '{':
+      closers.push_back('}');
+      break;
+    case ']':
+    case '}':
+      if (closers.empty()) {
+        // End of a scalar member
+        return i != start ? i : 0;
+      }
+      if (closers.back() != ch) {
+        return 0;
+      }
+      closers.pop_back();
+      if (closers.empty()) {
+        return i + 1;
+      }
+      break;
+    case ',':
+    case ':':
+      if (closers.empty()) {
+        return i != start ? i : 0;
+      }
+      break;
+    default:
+      // Scalars end at the same whitespace that the parser skips
+      if (closers.empty() && std::isspace(static_cast<unsigned char>(ch))) {
+        return i != start ? i : 0;
+      }
+      break;
+    }
+  }
+
+  return closers.empty() && !in_str ? i : 0;
+}
+
+inline size_t split_members(std::string_view json,
+                            std::vector<std::string_view> &members) {
+  size_t i = json.find_first_not_of(" \n\r\t\v\f");
+  if (i == json.npos || (json[i] != '[' && json[i] != '{')) {
+    return 0;
+  }
+
+  bool is_dict = json[i] == '{';
+  char close = is_dict ? '}' : ']';
+
+  auto skip_whitespace = [&json](size_t &i) {
+    while (i < json.size() &&
+           std::isspace(static_cast<unsigned char>(json[i]))) {
+      ++i;
+    }
+  };
+
+  i += 1;
+  skip_whitespace(i);
+  if (i < json.size() && json[i] == close) {
+    return i + 1;
+  }
+
+  while (i < json.size()) {
+    size_t begin = i;
+    size_t eaten = skip_value(json.substr(i));
+    if (eaten == 0) {
+      return 0;
+    }
+    i += eaten;
+
+    if (is_dict) {
+      skip_whitespace(i);
+      if (i >= json.size() || json[i] != ':') {
+        return 0;
+      }
+      eaten = skip_value(json.substr(i + 1));
+      if (eaten == 0) {
+        return 0;
+      }
+      i += eaten + 1;
+    }
+    members.push_back(json.substr(begin, i - begin));
+
+    skip_whitespace(i);
+    if (i >= json.size()) {
+      break;
+    }
+    if (json[i] == close) {
+      return i + 1;
+    }
+    if (json[i] != ',') {
+      break;
+    }
+    i += 1;
+    skip_whitespace(i);
+  }
+
+  return 0;
+}
+
+inline std::optional<std::pair<JSONString, JSONObject>>
+parse_member(std::string_view member, unsigned jobs,
+             ParseOptions const &opts) {
+  auto [keyobj, keyeaten] = parse(member);
+  if (keyeaten == 0 || !std::holds_alternative<JSONString>(keyobj.inner)) {
+    return std::nullopt;
+  }
+
+  size_t colon = member.find(':', keyeaten);
+  if (colon == member.npos) {
+    return std::nullopt;
+  }
+
+  std::string_view val = member.substr(colon + 1);
+  auto [valobj, valeaten] =
+      jobs > 1 ? parse_parallel(val, jobs, opts) : parse(val, opts);
+  if (valeaten == 0) {
+    return std::nullopt;
+  }
+
+  return std::pair{std::move(std::get<JSONString>(keyobj.inner)),
+                   std::move(valobj)};
+}
+
+inline std::pair<JSONObject, size_t> parse_parallel(std::string_view json,
+                                                    unsigned jobs,
+                                                    ParseOptions const &opts) {
+  // Below this size spawning threads costs more than it saves
+  constexpr size_t min_parallel_bytes = 64 * 1024;
+
+  std::vector<std::string_view> members;
+  size_t eaten = 0;
+  if (jobs > 1 && json.size() >= min_parallel_bytes) {
+    eaten = split_members(json, members);
+  }
+  if (eaten == 0 || members.empty()) {
+    return parse(json, opts);
+  }
+
+  bool is_dict = json[json.find_first_not_of(" \n\r\t\v\f")] == '{';
+  JSONLIST values(members.size(), JSONObject{nullptr});
+  std::vector<JSONString> keys(is_dict ? members.size() : 0);
+  std::atomic<bool> failed{false};
+
+  // Objects in an array become records as in a serial parse: the first one
+  // gives the shape, and every later one that matches it shares it, up to
+  // the first that does not. Workers try the shape on every object and
+  // note the earliest miss; records past it are turned into dicts after.
+  auto is_object = [&members](size_t k) {
+    size_t off = members[k].find_first_not_of(" \n\r\t\v\f");
+    return off != members[k].npos && members[k][off] == '{';
+  };
+  std::shared_ptr<const JSONShape> shape;
+  size_t first_object = members.size();
+  std::atomic<size_t> first_miss{members.size()};
+  if (!is_dict && !opts.lazy && !opts.insitu) {
+    for (first_object = 0;
+         first_object < members.size() && !is_object(first_object);
+         ++first_object) {
+    }
+    if (first_object < members.size()) {
+      auto [rec, receaten] = parse_record(members[first_object], nullptr, opts);
+      if (receaten != 0) {
+        shape = rec.get<JSONRecord>().shape;
+        values[first_object] = std::move(rec);
+      }
+    }
+  }
+
+  auto build = [&](size_t k, unsigned member_jobs) {
+    if (is_dict) {
+      auto kv = parse_member(members[k], member_jobs, opts);
+      if (!kv.has_value()) {
+        failed = true;
+        return;
+      }
+      keys[k] = std::move(kv->first);
+      values[k] = std::move(kv->second);
+      return;
+    }
+    if (shape && k == first_object) {
+      return;
+    }
+    if (shape && k > first_object && is_object(k)) {
+      auto [rec, receaten] = parse_record(members[k], shape, opts);
+      if (receaten != 0) {
+        values[k] = std::move(rec);
+        return;
+      }
+      size_t miss = first_miss.load();
+      while (k < miss && !first_miss.compare_exchange_weak(miss, k)) {
+      }
+    }
+    auto [obj, objeaten] = member_jobs > 1
+                               ? parse_parallel(members[k], member_jobs, opts)
+                               : parse(members[k], opts);
+    if (objeaten == 0) {
+      failed = true;
+      return;
+    }
+    values[k] = std::move(obj);
+  };
+
+  // Members larger than a thread's fair share are split again with the whole
+  // pool; the rest are batched into tasks of roughly equal byte size that
+  // idle threads claim one by one, so uneven members balance out.
+  size_t share = eaten / jobs;
+  size_t task_bytes = std::max<size_t>(eaten / (jobs * 8), 1);
+  std::vector<size_t> large;
+  std::vector<std::pair<size_t, size_t>> tasks;
+  size_t task_begin = 0, task_size = 0;
+  for (size_t k = 0; k < members.size(); ++k) {
+    if (members[k].size() > share) {
+      large.push_back(k);
+      if (task_begin != k) {
+        tasks.emplace_back(task_begin, k);
+      }
+      task_begin = k + 1;
+      task_size = 0;
+      continue;
+    }
+    task_size += members[k].size();
+    if (task_size >= task_bytes) {
+      tasks.emplace_back(task_begin, k + 1);
+      task_begin = k + 1;
+      task_size = 0;
+    }
+  }
+  if (task_begin != members.size()) {
+    tasks.emplace_back(task_begin, members.size());
+  }
+
+  run_tasks(tasks.size(), jobs, [&](size_t t) {
+    for (size_t k = tasks[t].first; k < tasks[t].second && !failed; ++k) {
+      build(k, 1);
+    }
+  });
+
+  for (size_t k : large) {
+    if (!failed) {
+      build(k, jobs);
+    }
+  }
+
+  if (failed) {
+    return {JSONObject{std::nullptr_t{}}, 0};
+  }
+
+  if (!is_dict) {
+    for (size_t k = first_miss + 1; k < members.size(); ++k) {
+      if (auto rec = std::get_if<JSONRecord>(&values[k].inner)) {
+        JSONDICT dict(opts.memory);
+        dict.reserve(rec->values.size());
+        for (size_t m = 0; m < rec->values.size(); ++m) {
+          dict.try_emplace(JSONString(rec->shape->keys[m], opts.memory),
+                           std::move(rec->values[m]));
+        }
+        values[k] = JSONObject{std::move(dict)};
+      }
+    }
+    return {pack_numbers(std::move(values)), eaten};
+  }
+
+  JSONDICT res;
+  res.reserve(members.size());
+  for (size_t k = 0; k < members.size(); ++k) {
+    res.try_emplace(std::move(keys[k]), std::move(values[k]));
+  }
+  return {JSONObject{std::move(res)}, eaten};
+}
+
+template <class F> void run_tasks(size_t count, unsigned jobs, F &&task) {
+  std::atomic<size_t> next{0};
+  auto worker = [&] {
+    for (size_t t = next++; t < count; t = next++) {
+      task(t);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned t = 1; t < std::min<size_t>(jobs, count); ++t) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+}
+
+inline std::vector<std::string_view> record_spans(std::string_view json) {
+  std::vector<std::string_view> spans;
+  size_t off = json.find_first_not_of(" \n\r\t\v\f");
+  if (off != json.npos && json[off] == '[') {
+    split_members(json, spans);
+  } else {
+    size_t from = 0;
+    while (auto line = next_record(json, from)) {
+      spans.push_back(*line);
+    }
+  }
+  return spans;
+}
+
+inline std::optional<std::string_view> next_record(std::string_view ndjson,
+                                                   size_t &from) {
+  while (from < ndjson.size()) {
+    size_t end = std::min(ndjson.find('\n', from), ndjson.size());
+    std::string_view line = ndjson.substr(from, end - from);
+    from = end + 1;
+    if (line.find_first_not_of(" \r\t\v\f") != line.npos) {
+      return line;
+    }
+  }
+  return std::nullopt;
+}
+
+inline std::pair<JSONObject const &, size_t>
+Parser::parse(std::string_view json) {
+  // The old document goes before the memory it lives in is handed out again
+  doc = JSONObject{nullptr};
+  arena.reset();
+  auto [obj, eaten] = ::parse(json, opts);
+  doc = std::move(obj);
+  return {doc, eaten};
+}
+
+inline ContainerSizes ContainerSizes::count(std::string_view json) {
+  ContainerSizes res;
+  res.base = json.data();
+  std::vector<size_t> open; // containers not closed yet, as indexes of sizes
+  for (size_t i = 0; i < json.size(); ++i) {
+    char ch = json[i];
+    if (ch == '"') {
+      for (++i; i < json.size() && json[i] != '"'; ++i) {
+        if (json[i] == '\\') {
+          ++i;
+        }
+      }
+    } else if (ch == '[' || ch == '{') {
+      // Every comma inside adds one to a container that is not empty
+      size_t next = json.find_first_not_of(" \n\r\t\v\f", i + 1);
+      bool empty =
+          next != json.npos && (json[next] == ']' || json[next] == '}');
+      open.push_back(res.sizes.size());
+      res.sizes.push_back({i, empty ? 0 : 1});
+    } else if (ch == ',' && !open.empty()) {
+      res.sizes[open.back()].second += 1;
+    } else if ((ch == ']' || ch == '}') && !open.empty()) {
+      open.pop_back();
+    }
+  }
+  return res;
+}
+
+inline std::optional<size_t> ContainerSizes::of(char const *open) const {
+  if (!base || open < base) {
+    return std::nullopt;
+  }
+  auto offset = static_cast<size_t>(open - base);
+  auto it = std::lower_bound(
+      sizes.begin(), sizes.end(), offset,
+      [](std::pair<size_t, size_t> const &entry, size_t off) {
+        return entry.first < off;
+      });
+  if (it == sizes.end() || it->first != offset) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+inline JSONObject to_number(std::string_view text,
+                            std::pmr::memory_resource *memory) {
+  if (auto num = try_parse_num<int>(text); num.has_value()) {
+    return JSONObject{*num};
+  }
+
+  // Up to 15 significant digits always survive the round trip through a
+  // double, unless the result is out of its normal range. The count here
+  // includes leading zeros, which only makes it stricter.
+  auto num = try_parse_num<double>(text);
+  size_t digits = 0;
+  for (char ch : text) {
+    if (ch == 'e' || ch == 'E') {
+      break;
+    }
+    digits += ch >= '0' && ch <= '9';
+  }
+  if (num.has_value() && std::isnormal(*num) && digits <= 15) {
+    return JSONObject{*num};
+  }
+
+  // Otherwise the double is exact when its shortest text denotes the same
+  // decimal, which also keeps zeros and integers up to 2^53. That text has
+  // at most 17 digits, so a longer number is never equal to it. Numbers
+  // written by another shortest printer usually match it byte for byte.
+  if (num.has_value() && std::isfinite(*num)) {
+    char buf[32];
+    auto res = std::to_chars(buf, buf + sizeof(buf), *num);
+    if (text == std::string_view(buf, static_cast<size_t>(res.ptr - buf))) {
+      return JSONObject{*num};
+    }
+    using Digits = std::pair<std::array<char, 17>, size_t>;
+    auto normal = [](std::string_view str, Digits &out) {
+      out.second = 0;
+      return decimal_digits(str, [&out](char ch) {
+        if (out.second == out.first.size()) {
+          return false;
+        }
+        out.first[out.second++] = ch;
+        return true;
+      });
+    };
+    Digits a{}, b{};
+    auto sign = normal(text, a);
+    if (sign && sign == normal({buf, static_cast<size_t>(res.ptr - buf)}, b) &&
+        a == b) {
+      return JSONObject{*num};
+    }
+  }
+  return JSONObject{JSONDecimal::from(text, memory)};
+}
+
+template <class F>
+std::optional<std::pair<bool, int64_t>> decimal_digits(std::string_view text,
+                                                       F &&put) {
+  size_t i = 0;
+  bool negative = false;
+  if (i < text.size() && text[i] == '-') {
+    negative = true;
+    ++i;
+  }
+
+  // Zeros are held back until a later digit shows they are not trailing.
+  // Digits after the point count the exponent down.
+  bool any = false;
+  int64_t zeros = 0;
+  int64_t fraction = 0;
+  bool after_point = false;
+  for (; i < text.size() && text[i] != 'e' && text[i] != 'E'; ++i) {
+    if (text[i] == '.') {
+      after_point = true;
+      continue;
+    }
+    fraction += after_point;
+    if (text[i] == '0') {
+      zeros += any;
+      continue;
+    }
+    for (; zeros > 0; --zeros) {
+      if (!put('0')) {
+        return std::nullopt;
+      }
+    }
+    if (!put(text[i])) {
+      return std::nullopt;
+    }
+    any = true;
+  }
+
+  // The written exponent saturates far beyond any representable magnitude
+  int64_t exponent = 0;
+  bool negative_exponent = false;
+  if (i < text.size()) {
+    ++i;
+    if (i < text.size() && (text[i] == '+' || text[i] == '-')) {
+      negative_exponent = text[i] == '-';
+      ++i;
+    }
+    for (; i < text.size(); ++i) {
+      exponent = std::min<int64_t>(exponent * 10 + (text[i] - '0'),
+                                   int64_t{1} << 48);
+    }
+  }
+  if (!any) {
+    return std::pair{negative, int64_t{0}};
+  }
+  return std::pair{negative, (negative_exponent ? -exponent : exponent) -
+                                 fraction + zeros};
+}
+
+inline JSONDecimal JSONDecimal::from(std::string_view text,
+                                     std::pmr::memory_resource *memory) {
+  // Built with its memory: moving a pmr string into place would keep the
+  // allocator of the target
+  JSONDecimal res{false, JSONString(memory), 0};
+  auto sign = decimal_digits(text, [&res](char ch) {
+    res.digits += ch;
+    return true;
+  });
+  std::tie(res.negative, res.exponent) = *sign;
+  return res;
+}
+
+inline double JSONDecimal::to_double() const {
+  std::string text = negative ? "-" : "";
+  text += digits.empty() ? std::string_view("0") : std::string_view(digits);
+  text += 'e';
+  text += std::to_string(exponent);
+  return std::strtod(text.c_str(), nullptr);
+}
+
+inline void JSONDecimal::dump(std::string &out) const {
+  // Integers are most likely written as such, so they stay plain up to as
+  // many trailing zeros as ECMAScript allows
+  if (!digits.empty() && exponent >= 0 && exponent <= 21) {
+    if (negative) {
+      out += '-';
+    }
+    out += digits;
+    out.append(static_cast<size_t>(exponent), '0');
+    return;
+  }
+  dump_decimal(negative, digits, exponent, out);
+}
+
+inline void dump_decimal(bool negative, std::string_view digits,
+                         int64_t exponent, std::string &out) {
+  if (digits.empty()) {
+    out += '0';
+    return;
+  }
+  if (negative) {
+    out += '-';
+  }
+
+  auto length = static_cast<int64_t>(digits.size());
+  int64_t point = length + exponent; // digits before the decimal point
+  if (exponent >= 0 && point <= 21) {
+    out += digits;
+    out.append(static_cast<size_t>(exponent), '0');
+  } else if (exponent < 0 && point > 0) {
+    out += digits.substr(0, static_cast<size_t>(point));
+    out += '.';
+    out += digits.substr(static_cast<size_t>(point));
+  } else if (exponent < 0 && point > -6) {
+    out += "0.";
+    out.append(static_cast<size_t>(-point), '0');
+    out += digits;
+  } else {
+    out += digits[0];
+    if (length > 1) {
+      out += '.';
+      out += digits.substr(1);
+    }
+    out += point > 0 ? "e+" : "e";
+    out += std::to_string(point - 1);
+  }
+}
+
+inline void dump_ecmascript(double num, std::string &out) {
+  // The shortest digits that read back as num; at most 17 of them
+  char buf[32];
+  auto res = std::to_chars(buf, buf + sizeof(buf), num,
+                           std::chars_format::scientific);
+  std::array<char, 17> digits{};
+  size_t length = 0;
+  auto sign = decimal_digits(
+      std::string_view(buf, static_cast<size_t>(res.ptr - buf)),
+      [&digits, &length](char ch) {
+        if (length == digits.size()) {
+          return false;
+        }
+        digits[length++] = ch;
+        return true;
+      });
+  dump_decimal(sign->first, std::string_view(digits.data(), length),
+               sign->second, out);
+}
+
+inline void JSONDecimal::do_print() const {
+  std::string text;
+  dump(text);
+  std::cout << text;
+}
+
+inline size_t scan_number(std::string_view json) {
+  size_t i = 0;
+  auto digits = [&json, &i] {
+    size_t from = i;
+    while (i < json.size() && json[i] >= '0' && json[i] <= '9') {
+      ++i;
+    }
+    return i - from;
+  };
+
+  if (i < json.size() && json[i] == '-') {
+    ++i;
+  }
+  if (i < json.size() && json[i] == '0') {
+    ++i;
+  } else if (digits() == 0) {
+    return 0;
+  }
+
+  size_t end = i;
+  if (i < json.size() && json[i] == '.') {
+    ++i;
+    if (digits() == 0) {
+      return end;
+    }
+    end = i;
+  }
+  if (i < json.size() && (json[i] == 'e' || json[i] == 'E')) {
+    ++i;
+    if (i < json.size() && (json[i] == '+' || json[i] == '-')) {
+      ++i;
+    }
+    if (digits() != 0) {
+      end = i;
+    }
+  }
+  return end;
+}
+
+template <class T> std::optional<T> try_parse_num(std::string_view str) {
+  T value;
+  auto res = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (res.ec == std::errc() && res.ptr == str.data() + str.size()) {
+    return value;
+  }
+  return std::nullopt;
+}
+
+template <class F> size_t unescape_unicode(std::string_view text, F &&put) {
+  auto unit = [text](size_t at) -> std::optional<uint32_t> {
+    if (at + 6 > text.size() || text[at] != '\\' || text[at + 1] != 'u') {
+      return std::nullopt;
+    }
+    uint32_t res = 0;
+    char const *last = text.data() + at + 6;
+    auto parsed = std::from_chars(text.data() + at + 2, last, res, 16);
+    if (parsed.ec != std::errc() || parsed.ptr != last) {
+      return std::nullopt;
+    }
+    return res;
+  };
+
+  auto first = unit(0);
+  if (!first.has_value()) {
+    return 0;
+  }
+  uint32_t code = *first;
+  size_t used = 6;
+  if (code >= 0xd800 && code < 0xdc00) {
+    auto second = unit(6);
+    if (second.has_value() && *second >= 0xdc00 && *second < 0xe000) {
+      code = 0x10000 + ((code - 0xd800) << 10) + (*second - 0xdc00);
+      used = 12;
+    } else {
+      code = 0xfffd;
+    }
+  } else if (code >= 0xdc00 && code < 0xe000) {
+    code = 0xfffd;
+  }
+
+  auto byte = [&put](uint32_t bits) { put(static_cast<char>(bits)); };
+  if (code < 0x80) {
+    byte(code);
+  } else if (code < 0x800) {
+    byte(0xc0 | code >> 6);
+    byte(0x80 | (code & 0x3f));
+  } else if (code < 0x10000) {
+    byte(0xe0 | code >> 12);
+    byte(0x80 | (code >> 6 & 0x3f));
+    byte(0x80 | (code & 0x3f));
+  } else {
+    byte(0xf0 | code >> 18);
+    byte(0x80 | (code >> 12 & 0x3f));
+    byte(0x80 | (code >> 6 & 0x3f));
+    byte(0x80 | (code & 0x3f));
+  }
+  return used;
+}
+
+inline char unescaped_char(char c) {
+  switch (c) {
+  case 'n':
+    return '\n';
+  case 'r':
+    return '\r';
+  case '0':
+    return '\0';
+  case 't':
+    return '\t';
+  case 'v':
+    return '\v';
+  case 'f':
+    return '\f';
+  case 'b':
+    return '\b';
+  case 'a':
+    return '\a';
+  default:
+    return c;
+  }
+}
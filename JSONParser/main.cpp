@@ -1,59 +1,179 @@
 #include "CLI11.hpp"
-#include "print.hpp"
-#include <charconv>
+#include "bench.hpp"
+#include "columns.hpp"
+#include "index.hpp"
+#include "json.hpp"
+#include "memory.hpp"
+#include "persistent.hpp"
+#include "query.hpp"
+#include "server.hpp"
+#include "writer.hpp"
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <filesystem>
 #include <iostream>
 #include <optional>
-#include <regex>
 #include <string>
 #include <string_view>
-#include <system_error>
-#include <unordered_map>
+#include <thread>
+#include <unistd.h>
 #include <utility>
-#include <variant>
 #include <vector>
 
-struct JSONObject;
-
-using JSONDICT = std::unordered_map<std::string, JSONObject>;
-using JSONLIST = std::vector<JSONObject>;
-
-struct JSONObject {
-  std::variant<std::nullptr_t, // none
-               bool,           // true & false
-               int,            // 3
-               double,         // 3,14
-               std::string,    // "hello"
-               JSONLIST,       // [true, 3]
-               JSONDICT        // {"hello": 3}
-               >
-      inner;
-
-  void do_print() const { printnl(inner); }
-
-  template <class T> bool is() { return std::holds_alternative<T>(inner); }
-
-  template <class T> T const &get() const { return std::get<T>(inner); }
-
-  template <class T> T &get() { return std::get<T>(inner); }
-};
-
-char unescaped_char(char c);
-
-template <class T> std::optional<T> try_parse_num(std::string_view str);
-
-std::pair<JSONObject, size_t> parse(std::string_view json);
-
 int main(int argc, char **argv) {
   CLI::App app{"a simple JSON parser"};
 
   std::string path;
+  std::string output;
+  std::string pointer;
+  std::vector<std::string> edits;
+  std::string columnar;
+  unsigned jobs = 1;
+  bool lazy = false;
+  bool intern = false;
 
   app.add_option("filepath", path, "JSON file to parse")->type_name("");
+  app.add_option("-j,--jobs", jobs, "Threads used to build large containers")
+      ->type_name("");
+  app.add_option("-o,--output", output, "Write the document as JSON to a file")
+      ->type_name("");
+  app.add_option("-p,--pointer", pointer, "Only output the value at a pointer")
+      ->type_name("");
+  app.add_flag("--lazy", lazy, "Parse nested containers on first access");
+  app.add_flag("--intern", intern, "Store repeated short strings once");
+  bool insitu = false;
+  app.add_flag("--insitu", insitu, "Decode strings inside the read buffer");
+  bool raw_numbers = false;
+  app.add_flag("--raw-numbers", raw_numbers,
+               "Keep numbers as their text and write them back unchanged");
+  bool use_arena = false;
+  app.add_flag("--arena", use_arena, "Allocate the document from one arena");
+  bool huge_pages = false;
+  app.add_flag("--huge-pages", huge_pages,
+               "Read the input and arena into 2 MB pages, implies --arena");
+  bool stream = false;
+  CLI::Option *stream_opt = app.add_flag(
+      "--stream", stream,
+      "Read a sequence of values, such as NDJSON or RFC 7464");
+  bool canonical = false;
+  app.add_flag("--canonical", canonical,
+               "Write RFC 8785 canonical JSON, as used for signing")
+      ->excludes(stream_opt);
+  app.add_option("--set", edits, "Set POINTER=JSON before output")
+      ->type_name("");
+  app.add_option("--columnar", columnar,
+                 "Write array or NDJSON records as csv or bin columns")
+      ->type_name("");
+  uint64_t record = 0;
+  CLI::Option *record_opt =
+      app.add_option("--record", record, "Print NDJSON record K, from 0")
+          ->type_name("");
+  std::string where;
+  app.add_option("--where", where, "Print NDJSON records with FIELD=VALUE")
+      ->type_name("");
+  std::string needle;
+  app.add_option("--contains", needle,
+                 "Print NDJSON records with a key or string equal to TEXT")
+      ->type_name("");
+
+  // Subcommands accept the options above after their own arguments
+  app.fallthrough();
+
+  CLI::App *bench =
+      app.add_subcommand("bench", "Time parse() from 1 to N jobs");
+  unsigned max_jobs = std::max(1u, std::thread::hardware_concurrency());
+  bench->add_option("filepath", path, "JSON file to parse")->type_name("");
+  bench->add_option("-n,--max-jobs", max_jobs, "Largest job count to time")
+      ->type_name("");
+  size_t messages = 0;
+  bench->add_option("-m,--messages", messages,
+                    "Time parsing this many records one by one instead")
+      ->type_name("");
+  bool pages = false;
+  bench->add_flag("--pages", pages,
+                  "Compare small and huge pages for the input and arena");
+  bool presize = false;
+  bench->add_flag("--presize", presize,
+                  "Compare growing containers with sizing them up front");
+  bool passthrough = false;
+  bench->add_flag("--raw-numbers", passthrough,
+                  "Compare parsing and dumping with and without raw numbers");
+  bool dicts = false;
+  bench->add_flag("--dicts", dicts,
+                  "Compare ordered dicts with a node-based hash map");
+
+  CLI::App *agg =
+      app.add_subcommand("agg", "Aggregate a field over NDJSON records");
+  std::string verb, field, group_by;
+  agg->add_option("verb", verb, "count, sum, min, max or avg")
+      ->required()
+      ->check(CLI::IsMember({"count", "sum", "min", "max", "avg"}))
+      ->type_name("");
+  agg->add_option("filepath", path, "JSON or NDJSON file")->type_name("");
+  agg->add_option("-f,--field", field, "Pointer or dotted path to aggregate")
+      ->type_name("");
+  agg->add_option("-g,--group-by", group_by, "Pointer or dotted path to group")
+      ->type_name("");
+
+  CLI::App *query =
+      app.add_subcommand("query", "Run a jq-like filter over JSON or NDJSON");
+  std::string filter;
+  query->add_option("filter", filter, "Filter such as 'select(.n > 1) | {id}'")
+      ->required()
+      ->type_name("");
+  query->add_option("filepath", path, "JSON or NDJSON file")->type_name("");
+  bool each = false;
+  query->add_flag("-e,--each", each,
+                  "Run on each element of top-level arrays instead");
+
+  CLI::App *index =
+      app.add_subcommand("index", "Index the records of an NDJSON file");
+  uint64_t every = 1024;
+  std::string index_key;
+  index->add_option("filepath", path, "NDJSON file to index")->type_name("");
+  index->add_option("-n,--every", every, "Keep the offset of every N-th record")
+      ->type_name("");
+  index->add_option("-k,--key", index_key, "Also index records by a field")
+      ->type_name("");
+  bool bloom = false;
+  size_t block_size = size_t{1} << 20;
+  index->add_flag("--bloom", bloom, "Also write filters for --contains");
+  index->add_option("-b,--block-size", block_size, "Bytes per filter block")
+      ->type_name("");
+
+  CLI::App *serve =
+      app.add_subcommand("serve", "Answer queries on documents kept in memory");
+  std::vector<std::string> served;
+  std::string socket_path;
+  unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+  serve->add_option("filepaths", served, "JSON or NDJSON files to keep")
+      ->type_name("");
+  serve->add_option("-s,--socket", socket_path, "Unix socket to listen on")
+      ->required()
+      ->type_name("");
+  serve->add_option("-w,--workers", workers, "Threads answering requests")
+      ->type_name("");
 
   CLI11_PARSE(app, argc, argv);
 
+  if (*serve) {
+    Server server;
+    for (auto const &file : served) {
+      if (!std::filesystem::exists(file)) {
+        std::cerr << "Invalid path.";
+        return -1;
+      }
+      if (!server.load(file, workers)) {
+        std::cerr << "Failed to load " << file << ".";
+        return -1;
+      }
+    }
+    server.serve(socket_path, workers);
+    std::cerr << "Failed to serve on socket.";
+    return -1;
+  }
+
   std::filesystem::path fs(path);
 
   if (!std::filesystem::exists(fs)) {
@@ -61,204 +181,284 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  std::ifstream infile(path);
-  std::string raw_json;
-  if (infile) {
-    raw_json.assign((std::istreambuf_iterator<char>(infile)),
-                    std::istreambuf_iterator<char>());
-  }
-
-  JSONObject obj = parse(raw_json).first;
-  print(obj);
-
-  return 0;
-}
-
-std::pair<JSONObject, size_t> parse(std::string_view json) {
-  // Parse empty
-  if (json.empty()) {
-    return {JSONObject{std::nullptr_t{}}, 0};
+  // Index builds and lookups map the file instead of reading all of it
+  if (*index) {
+    MappedFile file(path);
+    auto built = RecordIndex::build(file.view(), every, index_key, jobs);
+    if (!built.has_value()) {
+      std::cerr << "Invalid field path.";
+      return -1;
+    }
+    bool written = write_output(path + ".idx", {*built});
+    if (written && bloom) {
+      written = write_output(
+          path + ".bloom", {BloomIndex::build(file.view(), block_size, jobs)});
+    }
+    if (!written) {
+      std::cerr << "Failed to write output.";
+      return -1;
+    }
+    return 0;
   }
 
-  // Exclude leading escape characters
-  if (size_t off = json.find_first_not_of(" \n\r\t\v\f\0");
-      off != 0 && off != json.npos) {
-    auto [obj, eaten] = parse(json.substr(off));
-    return {std::move(obj), eaten + off};
+  if (!needle.empty()) {
+    MappedFile file(path);
+    MappedFile bloom_file(path + ".bloom");
+    auto filters = BloomIndex::load(bloom_file.view());
+    if (filters && filters->file_size != file.size) {
+      std::cerr << "Ignoring stale index.\n";
+      filters.reset();
+    }
+    for (auto line : find_containing(file.view(), filters ? &*filters : nullptr,
+                                     needle, jobs)) {
+      print(parse(line).first);
+    }
+    return 0;
   }
 
-  if (json.size() >= 4) {
-    // Parse null
-    if (json.substr(0, 4) == "null") {
-      return {JSONObject{std::nullptr_t{}}, 4};
+  if (*record_opt || !where.empty()) {
+    MappedFile file(path);
+    MappedFile index_file(path + ".idx");
+    auto found_index = RecordIndex::load(index_file.view());
+    if (found_index && found_index->file_size != file.size) {
+      std::cerr << "Ignoring stale index.\n";
+      found_index.reset();
     }
-
-    // Parse bool
-    if (json.substr(0, 4) == "true") {
-      return {JSONObject{true}, 4};
+    RecordIndex const *idx = found_index ? &*found_index : nullptr;
+
+    std::vector<std::string_view> found;
+    if (*record_opt) {
+      auto line = find_record(file.view(), idx, record);
+      if (!line.has_value()) {
+        std::cerr << "No such record.";
+        return -1;
+      }
+      found.push_back(*line);
+    } else {
+      std::string_view query = where;
+      size_t eq = query.find('=');
+      auto lines = eq == query.npos
+                       ? std::nullopt
+                       : find_records(file.view(), idx, query.substr(0, eq),
+                                      query.substr(eq + 1), jobs);
+      if (!lines.has_value()) {
+        std::cerr << "Invalid field path.";
+        return -1;
+      }
+      found = std::move(*lines);
     }
+    for (auto line : found) {
+      print(parse(line).first);
+    }
+    return 0;
   }
 
-  if (json.size() >= 5) {
-    if (json.substr(0, 5) == "false") {
-      return {JSONObject{false}, 5};
+  PageBuffer input = read_file(path, huge_pages);
+  std::string_view raw_json = input.view();
+
+  if (*bench) {
+    if (pages) {
+      bench_pages(raw_json);
+    } else if (presize) {
+      bench_presize(raw_json);
+    } else if (passthrough) {
+      bench_passthrough(raw_json);
+    } else if (dicts) {
+      bench_dicts(raw_json);
+    } else if (messages > 0) {
+      bench_messages(raw_json, messages);
+    } else {
+      bench_parse(raw_json, max_jobs);
     }
+    return 0;
   }
 
-  // Parse int & double
-  if (char ch = json[0]; (ch >= '0' && ch <= '9') || ch == '+' || ch == '-') {
-    std::regex num_regex{"-?(0|[1-9][0-9]*)(\\.[0-9]+)?([eE][+-]?[0-9]+)?"};
-    std::cmatch match;
-    if (std::regex_search(json.data(), json.data() + json.size(), match,
-                          num_regex)) {
-      std::string str = match.str();
-      if (auto num = try_parse_num<int>(str); num.has_value()) {
-        return {JSONObject{num.value()}, str.size()};
-      }
-
-      if (auto num = try_parse_num<double>(str); num.has_value()) {
-        return {JSONObject{num.value()}, str.size()};
-      }
+  if (*agg) {
+    auto result = aggregate(raw_json, verb, field, group_by, jobs);
+    if (!result.has_value()) {
+      std::cerr << "Invalid field path.";
+      return -1;
     }
+    std::cout << *result << "\n";
+    return 0;
   }
 
-  // Parse string
-  if (json[0] == '"') {
-    std::string str;
-    enum { Raw, Esc } phase = Raw;
-
-    size_t i = 1;
-    for (; i < json.size(); ++i) {
-      char ch = json[i];
-      if (phase == Raw) {
-        if (ch == '\\') {
-          phase = Esc;
-          continue;
-        } else if (ch == '"') {
-          i++;
+  if (*query) {
+    std::string error;
+    auto compiled = Query::compile(filter, error);
+    if (!compiled.has_value()) {
+      std::cerr << "Invalid filter: " << error << ".";
+      return -1;
+    }
+    auto spans = value_spans(raw_json, each);
+    if (!spans.has_value()) {
+      std::cerr << "Invalid JSON.";
+      return -1;
+    }
+
+    // Every task writes the outputs of its inputs into its own piece; the
+    // pieces are written in order, up to the first that failed
+    size_t per_task = std::max<size_t>(spans->size() / (size_t{jobs} * 8), 64);
+    size_t tasks = (spans->size() + per_task - 1) / per_task;
+    std::vector<std::string> pieces(tasks), errors(tasks);
+    run_tasks(tasks, jobs, [&](size_t t) {
+      size_t end = std::min(spans->size(), (t + 1) * per_task);
+      for (size_t k = t * per_task; k < end; ++k) {
+        if (!compiled->run((*spans)[k], pieces[t], errors[t])) {
           break;
-        } else {
-          str += ch;
         }
       }
+    });
+    auto failed = std::find_if(errors.begin(), errors.end(),
+                               [](std::string const &e) { return !e.empty(); });
+    pieces.resize(static_cast<size_t>(failed - errors.begin()) +
+                  (failed != errors.end()));
+    if (!write_output(output, pieces)) {
+      std::cerr << "Failed to write output.";
+      return -1;
+    }
+    if (failed != errors.end()) {
+      std::cerr << "Query failed: " << *failed << ".";
+      return -1;
+    }
+    return 0;
+  }
 
-      if (phase == Esc) {
-        str += unescaped_char(ch);
-        phase = Raw;
-      }
+  if (!columnar.empty()) {
+    if (columnar != "csv" && columnar != "bin") {
+      std::cerr << "Unknown columnar format.";
+      return -1;
     }
+    auto table = to_columns(raw_json, jobs);
+    if (!write_output(output, {columnar == "csv" ? table.csv()
+                                                 : table.binary()})) {
+      std::cerr << "Failed to write output.";
+      return -1;
+    }
+    return 0;
+  }
 
-    return {JSONObject{std::move(str)}, i};
+  // The arena outlives the document and frees all of it at once
+  StringPool pool;
+  Arena arena;
+  arena.huge = huge_pages;
+  use_arena = use_arena || huge_pages;
+  ParseOptions opts;
+  opts.lazy = lazy;
+  opts.intern = intern ? &pool : nullptr;
+  opts.insitu = insitu;
+  opts.raw_numbers = raw_numbers;
+
+  // Lazy parses leave most containers unparsed, so counting is not worth it
+  ContainerSizes sizes;
+  if (!lazy) {
+    sizes = ContainerSizes::count(raw_json);
+    opts.sizes = &sizes;
+  }
+  if (use_arena) {
+    opts.memory = &arena;
   }
 
-  auto skip_whitespace = [&json](size_t &i) {
-    while (i < json.size() &&
-           std::isspace(static_cast<unsigned char>(json[i]))) {
-      ++i;
+  if (stream) {
+    // Values are written as soon as they are parsed
+    int fd = output.empty() ? -1 : open_output(output);
+    if (!output.empty() && fd < 0) {
+      std::cerr << "Failed to write output.";
+      return -1;
     }
-  };
-
-  // Parse list
-  if (json[0] == '[') {
-    std::vector<JSONObject> res;
-    size_t i;
-    for (i = 1; i < json.size();) {
-      if (json[i] == ']') {
-        i += 1;
-        break;
-      }
-      auto [obj, eaten] = parse(json.substr(i));
-      if (eaten == 0) {
-        i = 0;
-        break;
-      }
-      res.push_back(std::move(obj));
-      i += eaten;
-
-      skip_whitespace(i);
-      if (json[i] == ',') {
-        i += 1;
+    JSONWriter writer(fd);
+    bool found = true;
+    size_t eaten = parse_stream(raw_json, opts, [&](JSONObject &value) {
+      JSONObject scratch{nullptr};
+      JSONObject const *target = find_pointer(value, pointer, scratch);
+      if (!target) {
+        found = false;
+      } else if (output.empty()) {
+        print(*target);
+      } else {
+        writer.value(*target);
+        writer.end_line();
       }
-      skip_whitespace(i);
+    });
+    if (eaten != raw_json.size()) {
+      std::cerr << "Invalid JSON.";
+      return -1;
     }
-    return {JSONObject{std::move(res)}, i};
+    if (!found) {
+      std::cerr << "No value at pointer.";
+      return -1;
+    }
+    bool written = writer.flush();
+    if (fd >= 0 && fd != STDOUT_FILENO) {
+      written = close(fd) == 0 && written;
+    }
+    if (!written) {
+      std::cerr << "Failed to write output.";
+      return -1;
+    }
+    return 0;
   }
 
-  // Parse dict
-  if (json[0] == '{') {
-    std::unordered_map<std::string, JSONObject> res;
-    size_t i;
-    for (i = 1; i < json.size();) {
-      if (json[i] == '}') {
-        i += 1;
-        break;
-      }
-      auto [keyobj, keyeaten] = parse(json.substr(i));
-      if (keyeaten == 0) {
-        i = 0;
-        break;
-      }
-      i += keyeaten;
-      if (!std::holds_alternative<std::string>(keyobj.inner)) {
-        i = 0;
-        break;
-      }
-
-      skip_whitespace(i);
-      if (json[i] == ':') {
-        i += 1;
-      }
-      skip_whitespace(i);
+  JSONObject obj{nullptr};
+  if (insitu) {
+    obj = parse_insitu(input.data, input.size, opts).first;
+  } else if (jobs > 1 && !lazy && !intern && !use_arena) {
+    obj = parse_parallel(raw_json, jobs, opts).first;
+  } else {
+    obj = parse(raw_json, opts).first;
+  }
 
-      std::string key = std::move(std::get<std::string>(keyobj.inner));
-      auto [valobj, valeaten] = parse(json.substr(i));
-      if (valeaten == 0) {
-        i = 0;
-        break;
+  if (!edits.empty()) {
+    auto doc = PersistentJSON::from(obj);
+    for (auto const &edit : edits) {
+      size_t eq = edit.find('=');
+      std::optional<PersistentJSON> next;
+      if (eq != edit.npos) {
+        auto [value, eaten] = parse(std::string_view(edit).substr(eq + 1));
+        if (eaten != 0) {
+          next = doc.set(std::string_view(edit).substr(0, eq), value);
+        }
       }
-      i += valeaten;
-      res.try_emplace(std::move(key), std::move(valobj));
-
-      skip_whitespace(i);
-      if (json[i] == ',') {
-        i += 1;
+      if (!next.has_value()) {
+        std::cerr << "Invalid edit.";
+        return -1;
       }
-      skip_whitespace(i);
+      doc = std::move(*next);
     }
-    return {JSONObject{std::move(res)}, i};
+    obj = doc.to_object();
   }
 
-  return {JSONObject{std::nullptr_t{}}, 0};
-}
+  JSONObject scratch{nullptr};
+  JSONObject const *target = find_pointer(obj, pointer, scratch);
+  if (!target) {
+    std::cerr << "No value at pointer.";
+    return -1;
+  }
 
-template <class T> std::optional<T> try_parse_num(std::string_view str) {
-  T value;
-  auto res = std::from_chars(str.data(), str.data() + str.size(), value);
-  if (res.ec == std::errc() && res.ptr == str.data() + str.size()) {
-    return value;
+  if (canonical) {
+    std::string text;
+    if (!dump_canonical(*target, text)) {
+      std::cerr << "Number out of the range of canonical JSON.";
+      return -1;
+    }
+    if (!write_output(output, {text})) {
+      std::cerr << "Failed to write output.";
+      return -1;
+    }
+    return 0;
   }
-  return std::nullopt;
-}
 
-char unescaped_char(char c) {
-  switch (c) {
-  case 'n':
-    return '\n';
-  case 'r':
-    return '\r';
-  case '0':
-    return '\0';
-  case 't':
-    return '\t';
-  case 'v':
-    return '\v';
-  case 'f':
-    return '\f';
-  case 'b':
-    return '\b';
-  case 'a':
-    return '\a';
-  default:
-    return c;
+  if (!output.empty()) {
+    std::vector<std::string> pieces;
+    dump_parallel(*target, jobs, pieces);
+    if (!write_output(output, pieces)) {
+      std::cerr << "Failed to write output.";
+      return -1;
+    }
+    return 0;
   }
+
+  print(*target);
+
+  return 0;
 }
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Memory for large buffers. With huge set it is mapped 2 MB aligned and
+// advised to use transparent huge pages, which cuts TLB misses on big
+// documents; when THP is off the mapping simply keeps small pages, and when
+// mapping fails the memory comes from the heap.
+struct PageBuffer {
+  static constexpr size_t huge_page = size_t{2} << 20;
+
+  PageBuffer() = default;
+  PageBuffer(size_t size_, bool huge_);
+  PageBuffer(PageBuffer const &) = delete;
+  PageBuffer &operator=(PageBuffer const &) = delete;
+  PageBuffer(PageBuffer &&other) noexcept;
+  PageBuffer &operator=(PageBuffer &&other) noexcept;
+  ~PageBuffer();
+
+  std::string_view view() const { return {data, size}; }
+
+  char *data = nullptr;
+  size_t size = 0;
+  size_t mapped = 0; // length of the mapping, 0 for heap memory
+  bool huge = false; // whether the kernel took the huge page advice
+};
+
+// Bump allocator whose reset() keeps its memory for the next round. When a
+// round needed more than one block they are merged into one, so that later
+// rounds of a similar size are served from a single block.
+struct Arena : std::pmr::memory_resource {
+  Arena() = default;
+  Arena(Arena const &) = delete;
+  Arena &operator=(Arena const &) = delete;
+
+  // Forget every allocation; nothing may use them afterwards
+  void reset();
+
+  void *do_allocate(size_t bytes, size_t align) override;
+  void do_deallocate(void *, size_t, size_t) override {}
+  bool do_is_equal(memory_resource const &other) const noexcept override {
+    return this == &other;
+  }
+
+  static constexpr size_t min_block = size_t{1} << 16;
+
+  bool huge = false; // take blocks from huge pages
+  std::vector<PageBuffer> blocks{};
+  size_t capacity = 0; // bytes in all blocks
+  char *next = nullptr;
+  size_t left = 0;
+};
+
+// Read a whole file into memory, from huge pages if asked; empty on error
+PageBuffer read_file(std::string const &path, bool huge);
+
+inline PageBuffer::PageBuffer(size_t size_, bool huge_) : size(size_) {
+  // An empty mapping would be told apart from heap memory by nothing
+  if (huge_ && size != 0) {
+    // Map a page more than needed and trim both ends to 2 MB boundaries
+    size_t length = (size + huge_page - 1) / huge_page * huge_page;
+    void *raw = mmap(nullptr, length + huge_page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw != MAP_FAILED) {
+      auto begin = reinterpret_cast<uintptr_t>(raw);
+      uintptr_t aligned = (begin + huge_page - 1) & ~(huge_page - 1);
+      if (aligned != begin) {
+        munmap(raw, aligned - begin);
+      }
+      if (size_t tail = begin + huge_page - aligned; tail != 0) {
+        munmap(reinterpret_cast<void *>(aligned + length), tail);
+      }
+      data = reinterpret_cast<char *>(aligned);
+      mapped = length;
+      huge = madvise(data, mapped, MADV_HUGEPAGE) == 0;
+      return;
+    }
+  }
+  data = new char[size];
+}
+
+inline PageBuffer::PageBuffer(PageBuffer &&other) noexcept
+    : data(std::exchange(other.data, nullptr)),
+      size(std::exchange(other.size, 0)),
+      mapped(std::exchange(other.mapped, 0)),
+      huge(std::exchange(other.huge, false)) {}
+
+inline PageBuffer &PageBuffer::operator=(PageBuffer &&other) noexcept {
+  std::swap(data, other.data);
+  std::swap(size, other.size);
+  std::swap(mapped, other.mapped);
+  std::swap(huge, other.huge);
+  return *this;
+}
+
+inline PageBuffer::~PageBuffer() {
+  if (mapped != 0) {
+    munmap(data, mapped);
+  } else {
+    delete[] data;
+  }
+}
+
+inline PageBuffer read_file(std::string const &path, bool huge) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st {};
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return {};
+  }
+
+  // Pipes, terminals and procfs files report no useful size; those are read
+  // until EOF into a buffer that doubles whenever it fills up
+  bool sized = S_ISREG(st.st_mode) && st.st_size > 0;
+  PageBuffer buffer(sized ? static_cast<size_t>(st.st_size) : size_t{64} << 10,
+                    huge);
+  size_t done = 0;
+  for (;;) {
+    if (done == buffer.size) {
+      if (sized) {
+        break;
+      }
+      PageBuffer grown(buffer.size * 2, huge);
+      std::memcpy(grown.data, buffer.data, done);
+      buffer = std::move(grown);
+    }
+    ssize_t got = read(fd, buffer.data + done, buffer.size - done);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    done += static_cast<size_t>(got);
+  }
+  buffer.size = done;
+  close(fd);
+  return buffer;
+}
+
+inline void Arena::reset() {
+  if (blocks.size() > 1) {
+    blocks.clear();
+    blocks.emplace_back(capacity, huge);
+  }
+  next = blocks.empty() ? nullptr : blocks.back().data;
+  left = blocks.empty() ? 0 : blocks.back().size;
+}
+
+inline void *Arena::do_allocate(size_t bytes, size_t align) {
+  void *ptr = next;
+  if (!ptr || !std::align(align, bytes, ptr, left)) {
+    size_t size = std::max({min_block, bytes + align, capacity});
+    blocks.emplace_back(size, huge);
+    capacity += size;
+    ptr = blocks.back().data;
+    left = size;
+    std::align(align, bytes, ptr, left);
+  }
+  next = static_cast<char *>(ptr) + bytes;
+  left -= bytes;
+  return ptr;
+}
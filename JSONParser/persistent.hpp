@@ -0,0 +1,740 @@
+#pragma once
+
+#include "json.hpp"
+#include "writer.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+struct PNode;
+using PValue = std::shared_ptr<const PNode>;
+
+// 32-way radix trie over indices: leaves hold values, inner nodes children
+struct PVecNode {
+  std::vector<std::shared_ptr<const PVecNode>> children{};
+  std::vector<PValue> values{};
+};
+
+// Persistent vector; updates copy one trie path and share the rest
+struct PList {
+  std::shared_ptr<const PVecNode> root{};
+  size_t size = 0;
+  unsigned shift = 0; // index bits above the leaf level
+
+  static PList from(std::vector<PValue> values);
+
+  PValue const &at(size_t i) const;
+  PList set(size_t i, PValue value) const;
+  PList push_back(PValue value) const;
+};
+
+// Hash array mapped trie node: the bitmap marks which of the 32 buckets for
+// the next 5 hash bits are present, slots stores only those. Once the hash
+// is used up, a node keeps colliding keys in plain order.
+struct HAMTNode {
+  struct Slot {
+    std::string key;
+    PValue value;
+    std::shared_ptr<const HAMTNode> child; // set for sub-tries
+    size_t order = 0; // when the key was first set, for insertion order
+  };
+
+  static constexpr unsigned hash_bits = sizeof(size_t) * CHAR_BIT;
+
+  uint32_t bitmap = 0;
+  std::vector<Slot> slots{};
+};
+
+// Persistent map; updates copy one trie path and share the rest. Members
+// keep the order their keys were first set in, like JSONDict: replacing a
+// value keeps its place and a new key goes last.
+struct PDict {
+  std::shared_ptr<const HAMTNode> root{};
+  size_t size = 0;
+  size_t next_order = 0;
+
+  PValue const *find(std::string_view key) const;
+  PDict set(std::string key, PValue value) const;
+  PDict erase(std::string_view key) const;
+
+  // Visit the members in insertion order
+  template <class F> void for_each(F &&f) const {
+    std::vector<HAMTNode::Slot const *> members;
+    members.reserve(size);
+    if (root) {
+      collect(*root, members);
+    }
+    std::sort(members.begin(), members.end(),
+              [](HAMTNode::Slot const *a, HAMTNode::Slot const *b) {
+                return a->order < b->order;
+              });
+    for (auto const *slot : members) {
+      f(slot->key, slot->value);
+    }
+  }
+
+  static void collect(HAMTNode const &node,
+                      std::vector<HAMTNode::Slot const *> &members);
+};
+
+struct PNode {
+  std::variant<std::nullptr_t, bool, int, double, std::string, JSONNumber,
+               JSONDecimal, PList, PDict>
+      inner;
+};
+
+// An immutable document. Every update returns a new version that shares all
+// untouched subtrees with this one, so a version costs memory proportional
+// to the edit, and a version can be read from any number of threads.
+struct PersistentJSON {
+  PValue root;
+
+  static PersistentJSON from(JSONObject const &obj);
+
+  // Subtree at an RFC 6901 pointer, or nullptr
+  PValue find(std::string_view pointer) const;
+  PValue find(std::vector<std::string> const &tokens) const;
+
+  // New version with the pointer set to value; "-" appends to an array
+  std::optional<PersistentJSON> set(std::string_view pointer,
+                                    JSONObject const &value) const;
+
+  // New version without the object member at the pointer
+  std::optional<PersistentJSON> erase(std::string_view pointer) const;
+
+  JSONObject to_object() const;
+};
+
+// The latest version of a document shared between threads. Readers are
+// lock-free: a snapshot counts itself into the readers of the current epoch,
+// copies the root and leaves, and only retries when a writer moved the epoch
+// on in between. Writers take turns, publish the new root with one pointer
+// store, then wait out the readers that may still be copying the old one
+// before freeing it. Readers never wait for a writer or for each other.
+struct VersionedJSON {
+  struct Version {
+    PValue root;
+  };
+
+  std::atomic<Version const *> current{nullptr};
+  mutable std::atomic<unsigned> epoch{0};
+  mutable std::array<std::atomic<size_t>, 2> readers{}; // by epoch parity
+  std::mutex writers{};
+
+  VersionedJSON() = default;
+  VersionedJSON(VersionedJSON const &) = delete;
+  VersionedJSON &operator=(VersionedJSON const &) = delete;
+  ~VersionedJSON();
+
+  PersistentJSON snapshot() const;
+
+  // Replace the whole document
+  void store(PValue root);
+
+  // Apply one edit to the latest version
+  bool set(std::string_view pointer, JSONObject const &value);
+
+  // With writers held: make next current and free the old version once no
+  // reader can still be copying its root
+  void publish(Version const *next);
+};
+
+void dump(PNode const &node, std::string &out);
+
+std::shared_ptr<const PVecNode> pvec_set(PVecNode const &node, unsigned level,
+                                         size_t i, PValue value);
+
+std::shared_ptr<const PVecNode> pvec_push(PVecNode const *node, unsigned level,
+                                          size_t i, PValue value);
+
+// A key that is not there yet is added with the given order
+std::shared_ptr<const HAMTNode> hamt_set(HAMTNode const *node, unsigned shift,
+                                         size_t hash, std::string &key,
+                                         PValue &value, size_t order,
+                                         bool &added);
+
+std::shared_ptr<const HAMTNode>
+hamt_erase(std::shared_ptr<const HAMTNode> const &node, unsigned shift,
+           size_t hash, std::string_view key);
+
+PValue to_persistent(JSONObject const &obj);
+
+JSONObject from_persistent(PNode const &node);
+
+// Copy the path to tokens[depth..] and put value at its end
+std::optional<PValue> persistent_set(PValue const &node,
+                                     std::vector<std::string> const &tokens,
+                                     size_t depth, PValue const &value);
+
+// Copy the path to tokens[depth..] and drop the member at its end
+std::optional<PValue> persistent_erase(PValue const &node,
+                                       std::vector<std::string> const &tokens,
+                                       size_t depth);
+
+inline void dump(PNode const &node, std::string &out) {
+  std::visit(
+      [&out](auto const &val) {
+        using T = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<T, PList>) {
+          out += '[';
+          for (size_t i = 0; i < val.size; ++i) {
+            if (i != 0) {
+              out += ',';
+            }
+            dump(*val.at(i), out);
+          }
+          out += ']';
+        } else if constexpr (std::is_same_v<T, PDict>) {
+          out += '{';
+          bool once = false;
+          val.for_each([&](std::string const &k, PValue const &v) {
+            if (once) {
+              out += ',';
+            } else {
+              once = true;
+            }
+            dump_string(k, out);
+            out += ':';
+            dump(*v, out);
+          });
+          out += '}';
+        } else if constexpr (std::is_same_v<T, std::string>) {
+          dump_string(val, out);
+        } else {
+          dump(JSONObject{val}, out);
+        }
+      },
+      node.inner);
+}
+
+inline PList PList::from(std::vector<PValue> values) {
+  PList list;
+  list.size = values.size();
+  if (values.empty()) {
+    return list;
+  }
+
+  // Pack values into full leaves, then leaves into parents, up to one root
+  std::vector<std::shared_ptr<const PVecNode>> level;
+  for (size_t i = 0; i < values.size(); i += 32) {
+    auto leaf = std::make_shared<PVecNode>();
+    for (size_t k = i; k < std::min(i + 32, values.size()); ++k) {
+      leaf->values.push_back(std::move(values[k]));
+    }
+    level.push_back(std::move(leaf));
+  }
+  while (level.size() > 1) {
+    std::vector<std::shared_ptr<const PVecNode>> parents;
+    for (size_t i = 0; i < level.size(); i += 32) {
+      auto parent = std::make_shared<PVecNode>();
+      for (size_t k = i; k < std::min(i + 32, level.size()); ++k) {
+        parent->children.push_back(std::move(level[k]));
+      }
+      parents.push_back(std::move(parent));
+    }
+    level = std::move(parents);
+    list.shift += 5;
+  }
+  list.root = std::move(level[0]);
+  return list;
+}
+
+inline PValue const &PList::at(size_t i) const {
+  PVecNode const *node = root.get();
+  for (unsigned level = shift; level > 0; level -= 5) {
+    node = node->children[(i >> level) & 31].get();
+  }
+  return node->values[i & 31];
+}
+
+inline PList PList::set(size_t i, PValue value) const {
+  PList copy = *this;
+  copy.root = pvec_set(*root, shift, i, std::move(value));
+  return copy;
+}
+
+inline PList PList::push_back(PValue value) const {
+  PList copy = *this;
+  if (root && size == (size_t{32} << shift)) {
+    // The trie is full, so the old root becomes the first child of a new one
+    auto grown = std::make_shared<PVecNode>();
+    grown->children.push_back(root);
+    copy.root = std::move(grown);
+    copy.shift += 5;
+  }
+  copy.root = pvec_push(copy.root.get(), copy.shift, size, std::move(value));
+  copy.size += 1;
+  return copy;
+}
+
+inline std::shared_ptr<const PVecNode>
+pvec_set(PVecNode const &node, unsigned level, size_t i, PValue value) {
+  auto copy = std::make_shared<PVecNode>(node);
+  if (level == 0) {
+    copy->values[i & 31] = std::move(value);
+  } else {
+    auto &child = copy->children[(i >> level) & 31];
+    child = pvec_set(*child, level - 5, i, std::move(value));
+  }
+  return copy;
+}
+
+inline std::shared_ptr<const PVecNode>
+pvec_push(PVecNode const *node, unsigned level, size_t i, PValue value) {
+  auto copy = node ? std::make_shared<PVecNode>(*node)
+                   : std::make_shared<PVecNode>();
+  if (level == 0) {
+    copy->values.push_back(std::move(value));
+    return copy;
+  }
+
+  size_t slot = (i >> level) & 31;
+  if (slot < copy->children.size()) {
+    copy->children[slot] = pvec_push(copy->children[slot].get(), level - 5, i,
+                                     std::move(value));
+  } else {
+    copy->children.push_back(
+        pvec_push(nullptr, level - 5, i, std::move(value)));
+  }
+  return copy;
+}
+
+inline PValue const *PDict::find(std::string_view key) const {
+  size_t hash = std::hash<std::string_view>{}(key);
+  HAMTNode const *node = root.get();
+  for (unsigned shift = 0; node; shift += 5) {
+    if (shift >= HAMTNode::hash_bits) {
+      for (auto const &slot : node->slots) {
+        if (slot.key == key) {
+          return &slot.value;
+        }
+      }
+      return nullptr;
+    }
+
+    uint32_t bit = 1u << ((hash >> shift) & 31);
+    if (!(node->bitmap & bit)) {
+      return nullptr;
+    }
+    auto const &slot = node->slots[static_cast<size_t>(
+        __builtin_popcount(node->bitmap & (bit - 1)))];
+    if (!slot.child) {
+      return slot.key == key ? &slot.value : nullptr;
+    }
+    node = slot.child.get();
+  }
+  return nullptr;
+}
+
+inline PDict PDict::set(std::string key, PValue value) const {
+  PDict copy = *this;
+  bool added = false;
+  size_t hash = std::hash<std::string_view>{}(key);
+  copy.root = hamt_set(root.get(), 0, hash, key, value, next_order, added);
+  copy.size += added ? 1 : 0;
+  copy.next_order += added ? 1 : 0;
+  return copy;
+}
+
+inline PDict PDict::erase(std::string_view key) const {
+  if (!root) {
+    return *this;
+  }
+  PDict copy = *this;
+  copy.root = hamt_erase(root, 0, std::hash<std::string_view>{}(key), key);
+  copy.size -= copy.root != root ? 1 : 0;
+  return copy;
+}
+
+inline void PDict::collect(HAMTNode const &node,
+                           std::vector<HAMTNode::Slot const *> &members) {
+  for (auto const &slot : node.slots) {
+    if (slot.child) {
+      collect(*slot.child, members);
+    } else {
+      members.push_back(&slot);
+    }
+  }
+}
+
+inline std::shared_ptr<const HAMTNode>
+hamt_set(HAMTNode const *node, unsigned shift, size_t hash, std::string &key,
+         PValue &value, size_t order, bool &added) {
+  auto copy = node ? std::make_shared<HAMTNode>(*node)
+                   : std::make_shared<HAMTNode>();
+  if (shift >= HAMTNode::hash_bits) {
+    for (auto &slot : copy->slots) {
+      if (slot.key == key) {
+        slot.value = std::move(value);
+        return copy;
+      }
+    }
+    copy->slots.push_back({std::move(key), std::move(value), nullptr, order});
+    added = true;
+    return copy;
+  }
+
+  uint32_t bit = 1u << ((hash >> shift) & 31);
+  auto slot = copy->slots.begin() +
+              __builtin_popcount(copy->bitmap & (bit - 1));
+  if (!(copy->bitmap & bit)) {
+    copy->bitmap |= bit;
+    copy->slots.insert(slot,
+                       {std::move(key), std::move(value), nullptr, order});
+    added = true;
+  } else if (slot->child) {
+    slot->child = hamt_set(slot->child.get(), shift + 5, hash, key, value,
+                           order, added);
+  } else if (slot->key == key) {
+    slot->value = std::move(value);
+  } else {
+    // Two keys share these hash bits, so both move one level down
+    bool resident_added = false;
+    size_t resident = std::hash<std::string_view>{}(slot->key);
+    auto child = hamt_set(nullptr, shift + 5, resident, slot->key, slot->value,
+                          slot->order, resident_added);
+    slot->child =
+        hamt_set(child.get(), shift + 5, hash, key, value, order, added);
+    slot->key.clear();
+    slot->value = nullptr;
+  }
+  return copy;
+}
+
+inline std::shared_ptr<const HAMTNode>
+hamt_erase(std::shared_ptr<const HAMTNode> const &node, unsigned shift,
+           size_t hash, std::string_view key) {
+  if (shift >= HAMTNode::hash_bits) {
+    for (size_t k = 0; k < node->slots.size(); ++k) {
+      if (node->slots[k].key == key) {
+        auto copy = std::make_shared<HAMTNode>(*node);
+        copy->slots.erase(copy->slots.begin() + static_cast<ptrdiff_t>(k));
+        return copy->slots.empty() ? nullptr : copy;
+      }
+    }
+    return node;
+  }
+
+  uint32_t bit = 1u << ((hash >> shift) & 31);
+  if (!(node->bitmap & bit)) {
+    return node;
+  }
+  auto k = static_cast<size_t>(__builtin_popcount(node->bitmap & (bit - 1)));
+  auto const &slot = node->slots[k];
+
+  // A null child afterwards means the slot itself has to go
+  std::shared_ptr<const HAMTNode> child;
+  if (slot.child) {
+    child = hamt_erase(slot.child, shift + 5, hash, key);
+    if (child == slot.child) {
+      return node;
+    }
+  } else if (slot.key != key) {
+    return node;
+  }
+
+  auto copy = std::make_shared<HAMTNode>(*node);
+  if (child) {
+    copy->slots[k].child = std::move(child);
+  } else {
+    copy->slots.erase(copy->slots.begin() + static_cast<ptrdiff_t>(k));
+    copy->bitmap &= ~bit;
+  }
+  return copy->slots.empty() ? nullptr : copy;
+}
+
+inline PValue to_persistent(JSONObject const &obj) {
+  return std::visit(
+      [](auto const &val) -> PValue {
+        using T = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<T, JSONLIST> ||
+                      std::is_same_v<T, JSONINTS> ||
+                      std::is_same_v<T, JSONDOUBLES>) {
+          std::vector<PValue> values;
+          values.reserve(val.size());
+          for (auto const &member : val) {
+            if constexpr (std::is_same_v<T, JSONLIST>) {
+              values.push_back(to_persistent(member));
+            } else {
+              values.push_back(std::make_shared<const PNode>(PNode{member}));
+            }
+          }
+          return std::make_shared<const PNode>(
+              PNode{PList::from(std::move(values))});
+        } else if constexpr (std::is_same_v<T, JSONDICT>) {
+          PDict dict;
+          for (auto const &[k, v] : val) {
+            dict = dict.set(std::string(k), to_persistent(v));
+          }
+          return std::make_shared<const PNode>(PNode{std::move(dict)});
+        } else if constexpr (std::is_same_v<T, JSONRecord>) {
+          PDict dict;
+          for (size_t k = 0; k < val.values.size(); ++k) {
+            dict = dict.set(val.shape->keys[k], to_persistent(val.values[k]));
+          }
+          return std::make_shared<const PNode>(PNode{std::move(dict)});
+        } else if constexpr (std::is_same_v<T, JSONLAZY>) {
+          return to_persistent(val->get());
+        } else if constexpr (std::is_same_v<T, JSONInterned>) {
+          return std::make_shared<const PNode>(
+              PNode{std::string(val.view())});
+        } else if constexpr (std::is_same_v<T, JSONSlice>) {
+          return std::make_shared<const PNode>(PNode{std::string(val.text)});
+        } else if constexpr (std::is_same_v<T, JSONNumber>) {
+          // Still a view into the parsed buffer, which keeps its text
+          return std::make_shared<const PNode>(PNode{val});
+        } else if constexpr (std::is_same_v<T, JSONString>) {
+          return std::make_shared<const PNode>(PNode{std::string(val)});
+        } else {
+          return std::make_shared<const PNode>(PNode{val});
+        }
+      },
+      obj.inner);
+}
+
+inline JSONObject from_persistent(PNode const &node) {
+  return std::visit(
+      [](auto const &val) -> JSONObject {
+        using T = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<T, PList>) {
+          JSONLIST list;
+          list.reserve(val.size);
+          for (size_t i = 0; i < val.size; ++i) {
+            list.push_back(from_persistent(*val.at(i)));
+          }
+          return pack_numbers(std::move(list));
+        } else if constexpr (std::is_same_v<T, PDict>) {
+          JSONDICT dict;
+          dict.reserve(val.size);
+          val.for_each([&dict](std::string const &k, PValue const &v) {
+            dict.try_emplace(JSONString(k), from_persistent(*v));
+          });
+          return JSONObject{std::move(dict)};
+        } else if constexpr (std::is_same_v<T, std::string>) {
+          return JSONObject{JSONString(val)};
+        } else {
+          return JSONObject{val};
+        }
+      },
+      node.inner);
+}
+
+inline std::optional<PValue>
+persistent_set(PValue const &node, std::vector<std::string> const &tokens,
+               size_t depth, PValue const &value) {
+  if (depth == tokens.size()) {
+    return value;
+  }
+
+  auto const &token = tokens[depth];
+  bool last = depth + 1 == tokens.size();
+  if (auto dict = std::get_if<PDict>(&node->inner)) {
+    PValue const *child = dict->find(token);
+    if (!child && !last) {
+      return std::nullopt;
+    }
+    auto updated =
+        persistent_set(child ? *child : nullptr, tokens, depth + 1, value);
+    if (!updated.has_value()) {
+      return std::nullopt;
+    }
+    return std::make_shared<const PNode>(
+        PNode{dict->set(token, std::move(*updated))});
+  }
+
+  if (auto list = std::get_if<PList>(&node->inner)) {
+    if (token == "-" && last) {
+      return std::make_shared<const PNode>(PNode{list->push_back(value)});
+    }
+    auto index = try_parse_num<size_t>(token);
+    if (!index.has_value() || *index >= list->size) {
+      return std::nullopt;
+    }
+    auto updated = persistent_set(list->at(*index), tokens, depth + 1, value);
+    if (!updated.has_value()) {
+      return std::nullopt;
+    }
+    return std::make_shared<const PNode>(
+        PNode{list->set(*index, std::move(*updated))});
+  }
+
+  return std::nullopt;
+}
+
+inline std::optional<PValue>
+persistent_erase(PValue const &node, std::vector<std::string> const &tokens,
+                 size_t depth) {
+  auto const &token = tokens[depth];
+  bool last = depth + 1 == tokens.size();
+  if (auto dict = std::get_if<PDict>(&node->inner)) {
+    PValue const *child = dict->find(token);
+    if (!child) {
+      return std::nullopt;
+    }
+    if (last) {
+      return std::make_shared<const PNode>(PNode{dict->erase(token)});
+    }
+    auto updated = persistent_erase(*child, tokens, depth + 1);
+    if (!updated.has_value()) {
+      return std::nullopt;
+    }
+    return std::make_shared<const PNode>(
+        PNode{dict->set(token, std::move(*updated))});
+  }
+
+  if (auto list = std::get_if<PList>(&node->inner); list && !last) {
+    auto index = try_parse_num<size_t>(token);
+    if (!index.has_value() || *index >= list->size) {
+      return std::nullopt;
+    }
+    auto updated = persistent_erase(list->at(*index), tokens, depth + 1);
+    if (!updated.has_value()) {
+      return std::nullopt;
+    }
+    return std::make_shared<const PNode>(
+        PNode{list->set(*index, std::move(*updated))});
+  }
+
+  return std::nullopt;
+}
+
+inline PersistentJSON PersistentJSON::from(JSONObject const &obj) {
+  return {to_persistent(obj)};
+}
+
+inline PValue PersistentJSON::find(std::string_view pointer) const {
+  auto tokens = split_pointer(pointer);
+  return tokens.has_value() ? find(*tokens) : nullptr;
+}
+
+inline PValue
+PersistentJSON::find(std::vector<std::string> const &tokens) const {
+  PValue cur = root;
+  for (auto const &token : tokens) {
+    if (auto dict = std::get_if<PDict>(&cur->inner)) {
+      PValue const *child = dict->find(token);
+      if (!child) {
+        return nullptr;
+      }
+      cur = *child;
+    } else if (auto list = std::get_if<PList>(&cur->inner)) {
+      auto index = try_parse_num<size_t>(token);
+      if (!index.has_value() || *index >= list->size) {
+        return nullptr;
+      }
+      cur = list->at(*index);
+    } else {
+      return nullptr;
+    }
+  }
+  return cur;
+}
+
+inline std::optional<PersistentJSON>
+PersistentJSON::set(std::string_view pointer, JSONObject const &value) const {
+  auto tokens = split_pointer(pointer);
+  if (!tokens.has_value()) {
+    return std::nullopt;
+  }
+  auto updated = persistent_set(root, *tokens, 0, to_persistent(value));
+  if (!updated.has_value()) {
+    return std::nullopt;
+  }
+  return PersistentJSON{std::move(*updated)};
+}
+
+inline std::optional<PersistentJSON>
+PersistentJSON::erase(std::string_view pointer) const {
+  auto tokens = split_pointer(pointer);
+  if (!tokens.has_value() || tokens->empty()) {
+    return std::nullopt;
+  }
+  auto updated = persistent_erase(root, *tokens, 0);
+  if (!updated.has_value()) {
+    return std::nullopt;
+  }
+  return PersistentJSON{std::move(*updated)};
+}
+
+inline JSONObject PersistentJSON::to_object() const {
+  return from_persistent(*root);
+}
+
+inline VersionedJSON::~VersionedJSON() { delete current.load(); }
+
+inline PersistentJSON VersionedJSON::snapshot() const {
+  unsigned e = epoch.load();
+  for (;;) {
+    readers[e & 1].fetch_add(1);
+    // A writer that moved the epoch on may already be past waiting for this
+    // count, so the reader joins the new epoch instead
+    unsigned now = epoch.load();
+    if (now == e) {
+      break;
+    }
+    readers[e & 1].fetch_sub(1);
+    e = now;
+  }
+  Version const *version = current.load();
+  PValue root = version ? version->root : nullptr;
+  readers[e & 1].fetch_sub(1, std::memory_order_release);
+  return {std::move(root)};
+}
+
+inline void VersionedJSON::store(PValue root) {
+  std::lock_guard<std::mutex> lock(writers);
+  publish(new Version{std::move(root)});
+}
+
+inline bool VersionedJSON::set(std::string_view pointer,
+                               JSONObject const &value) {
+  auto tokens = split_pointer(pointer);
+  if (!tokens.has_value()) {
+    return false;
+  }
+
+  // The edit is built from the latest root outside of any reader's way;
+  // holding writers keeps that root from being replaced meanwhile
+  PValue node = to_persistent(value);
+  std::lock_guard<std::mutex> lock(writers);
+  Version const *latest = current.load();
+  if (!latest) {
+    return false;
+  }
+  auto updated = persistent_set(latest->root, *tokens, 0, node);
+  if (!updated.has_value()) {
+    return false;
+  }
+  publish(new Version{std::move(*updated)});
+  return true;
+}
+
+inline void VersionedJSON::publish(Version const *next) {
+  Version const *old = current.exchange(next);
+
+  // A reader still copying old counted itself under one of the two epoch
+  // parities. Moving the epoch on and waiting for the parity it left to
+  // drain, twice, outlasts that reader, while new ones count under the
+  // other parity and can only see next.
+  for (int flip = 0; flip < 2; ++flip) {
+    unsigned e = epoch.fetch_add(1);
+    while (readers[e & 1].load(std::memory_order_acquire) != 0) {
+      std::this_thread::yield();
+    }
+  }
+  delete old;
+}
@@ -0,0 +1,1373 @@
+#pragma once
+
+#include "json.hpp"
+#include "writer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// A jq-like filter compiled to a tree of closures. It knows paths (.a.b,
+// ."key", .[0], .[]), pipes, commas, literals, array and object
+// construction, + - * / %, comparisons, and, or, //, ? and the builtins
+// select, map, length, keys, add, not and empty.
+struct Query {
+  using Path = std::vector<std::string>;
+
+  // Takes each output; false stops the evaluation
+  using Emit = std::function<bool(JSONObject const &)>;
+
+  // Evaluate against an input; false with a message on errors
+  using Filter =
+      std::function<bool(JSONObject const &, Emit const &, std::string &)>;
+
+  // Given where the input lies in the record, or nullopt when it is not
+  // part of it, add the paths whose whole values the filter reads and
+  // return where the output lies the same way
+  using Reads = std::function<std::optional<Path>(std::optional<Path> const &,
+                                                  std::vector<Path> &)>;
+
+  struct Step {
+    Filter run;
+    Reads reads;
+  };
+
+  Step root{};
+
+  // Fields of a record the filter reads, none a prefix of another; one
+  // empty path when it needs the whole record
+  std::vector<Path> reads{};
+
+  static std::optional<Query> compile(std::string_view expr,
+                                      std::string &error);
+
+  // The record json with only the fields the filter reads, or all of it
+  // when they cannot be projected; nullopt when it is not valid
+  std::optional<JSONObject> input(std::string_view json) const;
+
+  // Append the outputs for the record json as lines of JSON
+  bool run(std::string_view json, std::string &out, std::string &error) const;
+};
+
+// Recursive descent over a filter, one method per level of precedence from
+// the loosest to the tightest. Methods return nullopt with a message in
+// error on bad input.
+struct QueryParser {
+  std::string_view text;
+  size_t pos = 0;
+  std::string error{};
+
+  std::optional<Query::Step> pipe();
+  std::optional<Query::Step> comma();
+  std::optional<Query::Step> alternative();
+  std::optional<Query::Step> disjunction();
+  std::optional<Query::Step> conjunction();
+  std::optional<Query::Step> comparison();
+  std::optional<Query::Step> sum();
+  std::optional<Query::Step> product();
+  std::optional<Query::Step> postfix();
+  std::optional<Query::Step> term();
+  std::optional<Query::Step> object();
+
+  // The .name, ."name", [..] or ? after a term, if one follows
+  std::optional<Query::Step> suffix(Query::Step const &step, bool &found);
+
+  // A string literal at pos, kept as its decoded text
+  std::optional<std::string> string();
+
+  // Skip whitespace and take token if it comes next; words must not run
+  // on into an identifier
+  bool eat(std::string_view token);
+  bool eat_word(std::string_view word);
+
+  // The identifier at pos, or an empty view
+  std::string_view identifier();
+
+  std::nullopt_t fail(std::string message);
+};
+
+// Steps the parser combines
+Query::Step query_identity();
+Query::Step query_literal(JSONObject value);
+Query::Step query_field(std::string name);
+Query::Step query_index(Query::Step index);
+Query::Step query_iterate();
+Query::Step query_optional(Query::Step inner);
+Query::Step query_pipe(Query::Step a, Query::Step b);
+Query::Step query_comma(Query::Step a, Query::Step b);
+Query::Step query_binary(std::string op, Query::Step a, Query::Step b);
+Query::Step query_logic(bool is_and, Query::Step a, Query::Step b);
+Query::Step query_alternative(Query::Step a, Query::Step b);
+Query::Step query_array(Query::Step inner);
+Query::Step
+query_object(std::vector<std::pair<Query::Step, Query::Step>> entries);
+Query::Step query_select(Query::Step cond);
+
+// A builtin that only looks at its input, such as length, or nullopt
+std::optional<Query::Step> query_builtin(std::string_view name);
+
+// Where no path is known the input is read as a whole
+void query_materialize(std::optional<Query::Path> const &path,
+                       std::vector<Query::Path> &needs);
+
+// Rank of a value's kind in jq's order: null, false, true, numbers,
+// strings, arrays, objects
+int query_kind(JSONObject const &val);
+
+char const *query_kind_name(JSONObject const &val);
+
+// Order of two values, first by kind as above
+int query_compare(JSONObject const &a, JSONObject const &b);
+
+bool query_truthy(JSONObject const &val);
+
+std::optional<double> query_number(JSONObject const &val);
+
+// Call f with the key and value of each member of an object or record
+// until it returns false; returns whether it always returned true
+template <class F> bool query_members(JSONObject const &obj, F &&f);
+
+// Call emit with each element of an array or value of an object
+bool query_each(JSONObject const &val, Query::Emit const &emit,
+                std::string &error);
+
+// Apply + - * / or % as jq does; false with a message when the kinds do
+// not go together
+bool query_arith(char op, JSONObject const &a, JSONObject const &b,
+                 JSONObject &res, std::string &error);
+
+// Set key in dict, replacing an earlier value as object construction does
+void query_set(JSONDICT &dict, std::string_view key, JSONObject value);
+
+// Spans of the values in json, or with each the elements of top-level
+// arrays in their place; nullopt when a value is malformed
+std::optional<std::vector<std::string_view>> value_spans(std::string_view json,
+                                                         bool each);
+
+inline std::optional<Query> Query::compile(std::string_view expr,
+                                           std::string &error) {
+  QueryParser parser{expr};
+  auto step = parser.pipe();
+  parser.eat("");
+  if (step.has_value() && parser.pos < expr.size()) {
+    step = parser.fail("unexpected '" +
+                       std::string(expr.substr(parser.pos, 1)) + "'");
+  }
+  if (!step.has_value()) {
+    error = parser.error;
+    return std::nullopt;
+  }
+
+  Query query;
+  query.root = std::move(*step);
+  std::vector<Path> needs;
+  query_materialize(query.root.reads(Path{}, needs), needs);
+
+  // Reading a path covers everything below it. Numeric tokens would let
+  // project() index arrays where jq would fail, so they read the whole
+  // record instead.
+  std::sort(needs.begin(), needs.end());
+  for (auto &path : needs) {
+    bool covered = !query.reads.empty() &&
+                   query.reads.back().size() <= path.size() &&
+                   std::equal(query.reads.back().begin(),
+                              query.reads.back().end(), path.begin());
+    if (covered) {
+      continue;
+    }
+    for (auto const &token : path) {
+      if (try_parse_num<size_t>(token).has_value()) {
+        path.clear();
+      }
+    }
+    if (path.empty()) {
+      query.reads = {Path{}};
+      break;
+    }
+    query.reads.push_back(std::move(path));
+  }
+  return query;
+}
+
+inline std::optional<JSONObject> Query::input(std::string_view json) const {
+  auto whole = [json]() -> std::optional<JSONObject> {
+    auto [obj, eaten] = parse(json);
+    if (eaten == 0) {
+      return std::nullopt;
+    }
+    return obj;
+  };
+  if (!reads.empty() && reads[0].empty()) {
+    return whole();
+  }
+
+  // A sparse copy of the record, with objects only along the read paths
+  JSONObject res{JSONDICT()};
+  for (auto const &path : reads) {
+    auto raw = project(json, path);
+    if (!raw.has_value()) {
+      // A path that ends at a missing member or at a null reads as null,
+      // like the absent member it is left as. Under anything else jq would
+      // fail, which only the whole record reproduces.
+      bool absent = false;
+      for (size_t depth = path.size(); depth-- > 0 && !absent;) {
+        auto parent = project(json, Path(path.begin(), path.begin() + depth));
+        if (parent.has_value()) {
+          if (parent->empty() || ((*parent)[0] != '{' && *parent != "null")) {
+            return whole();
+          }
+          absent = true;
+        }
+      }
+      if (!absent) {
+        return whole();
+      }
+      continue;
+    }
+    auto [value, eaten] = parse(*raw);
+    if (eaten == 0) {
+      return std::nullopt;
+    }
+    JSONObject *cur = &res;
+    for (size_t k = 0; k + 1 < path.size(); ++k) {
+      auto &dict = std::get<JSONDICT>(cur->inner);
+      auto it = dict.find(path[k]);
+      if (it == dict.end()) {
+        it = dict.try_emplace(JSONString(path[k]), JSONObject{JSONDICT()})
+                 .first;
+      }
+      cur = &it->second;
+    }
+    std::get<JSONDICT>(cur->inner)
+        .try_emplace(JSONString(path.back()), std::move(value));
+  }
+  return res;
+}
+
+inline bool Query::run(std::string_view json, std::string &out,
+                       std::string &error) const {
+  auto in = input(json);
+  if (!in.has_value()) {
+    error = "invalid JSON";
+    return false;
+  }
+  return root.run(
+      *in,
+      [&out](JSONObject const &val) {
+        dump(val, out);
+        out += '\n';
+        return true;
+      },
+      error);
+}
+
+inline std::optional<Query::Step> QueryParser::pipe() {
+  auto lhs = comma();
+  while (lhs.has_value() && eat("|")) {
+    auto rhs = comma();
+    if (!rhs.has_value()) {
+      return std::nullopt;
+    }
+    lhs = query_pipe(std::move(*lhs), std::move(*rhs));
+  }
+  return lhs;
+}
+
+inline std::optional<Query::Step> QueryParser::comma() {
+  auto lhs = alternative();
+  while (lhs.has_value() && eat(",")) {
+    auto rhs = alternative();
+    if (!rhs.has_value()) {
+      return std::nullopt;
+    }
+    lhs = query_comma(std::move(*lhs), std::move(*rhs));
+  }
+  return lhs;
+}
+
+inline std::optional<Query::Step> QueryParser::alternative() {
+  auto lhs = disjunction();
+  while (lhs.has_value() && eat("//")) {
+    auto rhs = disjunction();
+    if (!rhs.has_value()) {
+      return std::nullopt;
+    }
+    lhs = query_alternative(std::move(*lhs), std::move(*rhs));
+  }
+  return lhs;
+}
+
+inline std::optional<Query::Step> QueryParser::disjunction() {
+  auto lhs = conjunction();
+  while (lhs.has_value() && eat_word("or")) {
+    auto rhs = conjunction();
+    if (!rhs.has_value()) {
+      return std::nullopt;
+    }
+    lhs = query_logic(false, std::move(*lhs), std::move(*rhs));
+  }
+  return lhs;
+}
+
+inline std::optional<Query::Step> QueryParser::conjunction() {
+  auto lhs = comparison();
+  while (lhs.has_value() && eat_word("and")) {
+    auto rhs = comparison();
+    if (!rhs.has_value()) {
+      return std::nullopt;
+    }
+    lhs = query_logic(true, std::move(*lhs), std::move(*rhs));
+  }
+  return lhs;
+}
+
+inline std::optional<Query::Step> QueryParser::comparison() {
+  auto lhs = sum();
+  if (!lhs.has_value()) {
+    return std::nullopt;
+  }
+  // Longer operators first, so that <= is not taken for <
+  for (std::string_view op : {"==", "!=", "<=", ">=", "<", ">"}) {
+    if (eat(op)) {
+      auto rhs = sum();
+      if (!rhs.has_value()) {
+        return std::nullopt;
+      }
+      return query_binary(std::string(op), std::move(*lhs), std::move(*rhs));
+    }
+  }
+  return lhs;
+}
+
+inline std::optional<Query::Step> QueryParser::sum() {
+  auto lhs = product();
+  while (lhs.has_value()) {
+    std::string_view op = eat("+") ? "+" : eat("-") ? "-" : "";
+    if (op.empty()) {
+      break;
+    }
+    auto rhs = product();
+    if (!rhs.has_value()) {
+      return std::nullopt;
+    }
+    lhs = query_binary(std::string(op), std::move(*lhs), std::move(*rhs));
+  }
+  return lhs;
+}
+
+inline std::optional<Query::Step> QueryParser::product() {
+  auto lhs = postfix();
+  while (lhs.has_value()) {
+    // // is the alternative operator, which binds looser
+    size_t start = pos;
+    if (eat("//")) {
+      pos = start;
+      break;
+    }
+    std::string_view op = eat("*")   ? "*"
+                          : eat("/") ? "/"
+                          : eat("%") ? "%"
+                                     : "";
+    if (op.empty()) {
+      break;
+    }
+    auto rhs = postfix();
+    if (!rhs.has_value()) {
+      return std::nullopt;
+    }
+    lhs = query_binary(std::string(op), std::move(*lhs), std::move(*rhs));
+  }
+  return lhs;
+}
+
+inline std::optional<Query::Step> QueryParser::postfix() {
+  auto step = term();
+  for (bool found = true; step.has_value() && found;) {
+    auto next = suffix(*step, found);
+    if (found) {
+      step = std::move(next);
+    }
+  }
+  return step;
+}
+
+inline std::optional<Query::Step> QueryParser::suffix(Query::Step const &step,
+                                                      bool &found) {
+  found = true;
+  if (eat("?")) {
+    return query_optional(step);
+  }
+
+  std::optional<Query::Step> last;
+  size_t start = pos;
+  if (eat("[")) {
+    if (eat("]")) {
+      last = query_iterate();
+    } else {
+      // A quoted key in brackets is a plain field, which can be projected
+      size_t key = pos;
+      if (eat("\"")) {
+        pos -= 1;
+        auto name = string();
+        if (name.has_value() && eat("]")) {
+          last = query_field(std::move(*name));
+        } else {
+          pos = key;
+        }
+      }
+      if (!last.has_value()) {
+        auto index = pipe();
+        if (!index.has_value()) {
+          return std::nullopt;
+        }
+        if (!eat("]")) {
+          return fail("expected ']'");
+        }
+        last = query_index(std::move(*index));
+      }
+    }
+  } else if (eat(".")) {
+    // Only a . directly followed by a name or [ continues the path
+    if (pos < text.size() && text[pos] == '"') {
+      auto name = string();
+      if (!name.has_value()) {
+        return std::nullopt;
+      }
+      last = query_field(std::move(*name));
+    } else if (auto name = identifier(); !name.empty()) {
+      last = query_field(std::string(name));
+    } else if (pos < text.size() && text[pos] == '[') {
+      return suffix(step, found);
+    }
+  }
+  if (!last.has_value()) {
+    pos = start;
+    found = false;
+    return std::nullopt;
+  }
+
+  // As in jq, a ? right after a step only covers that step
+  if (eat("?")) {
+    last = query_optional(std::move(*last));
+  }
+  return query_pipe(step, std::move(*last));
+}
+
+inline std::optional<Query::Step> QueryParser::term() {
+  eat("");
+  if (pos >= text.size()) {
+    return fail("unexpected end of filter");
+  }
+
+  char ch = text[pos];
+  if (ch == '.') {
+    // A lone . is the input; the name of .name is taken as a suffix
+    bool found = false;
+    auto field = suffix(query_identity(), found);
+    if (found) {
+      return field;
+    }
+    if (!error.empty()) {
+      return std::nullopt;
+    }
+    pos += 1;
+    return query_identity();
+  }
+  if (ch == '"') {
+    auto str = string();
+    if (!str.has_value()) {
+      return std::nullopt;
+    }
+    return query_literal(JSONObject{JSONString(*str)});
+  }
+  if (ch >= '0' && ch <= '9') {
+    size_t length = scan_number(text.substr(pos));
+    JSONObject num = to_number(text.substr(pos, length));
+    pos += length;
+    return query_literal(std::move(num));
+  }
+  if (eat("-")) {
+    auto negated = postfix();
+    if (!negated.has_value()) {
+      return std::nullopt;
+    }
+    return query_binary("-", query_literal(JSONObject{0}),
+                        std::move(*negated));
+  }
+  if (eat("(")) {
+    auto inner = pipe();
+    if (inner.has_value() && !eat(")")) {
+      return fail("expected ')'");
+    }
+    return inner;
+  }
+  if (eat("[")) {
+    if (eat("]")) {
+      return query_literal(JSONObject{JSONLIST()});
+    }
+    auto inner = pipe();
+    if (inner.has_value() && !eat("]")) {
+      return fail("expected ']'");
+    }
+    return inner.has_value() ? std::optional(query_array(std::move(*inner)))
+                             : std::nullopt;
+  }
+  if (eat("{")) {
+    return object();
+  }
+
+  auto name = identifier();
+  if (name == "true" || name == "false") {
+    return query_literal(JSONObject{name == "true"});
+  }
+  if (name == "null") {
+    return query_literal(JSONObject{nullptr});
+  }
+  if (name == "select" || name == "map") {
+    if (!eat("(")) {
+      return fail("expected '(' after " + std::string(name));
+    }
+    auto arg = pipe();
+    if (arg.has_value() && !eat(")")) {
+      return fail("expected ')'");
+    }
+    if (!arg.has_value()) {
+      return std::nullopt;
+    }
+    if (name == "select") {
+      return query_select(std::move(*arg));
+    }
+    // map(f) is [.[] | f]
+    return query_array(query_pipe(query_iterate(), std::move(*arg)));
+  }
+  if (auto builtin = query_builtin(name)) {
+    return builtin;
+  }
+  if (name.empty()) {
+    return fail("unexpected '" + std::string(1, ch) + "'");
+  }
+  return fail("unknown function " + std::string(name));
+}
+
+inline std::optional<Query::Step> QueryParser::object() {
+  std::vector<std::pair<Query::Step, Query::Step>> entries;
+  if (eat("}")) {
+    return query_object(std::move(entries));
+  }
+  for (;;) {
+    eat("");
+    std::optional<Query::Step> key;
+    std::optional<std::string> name;
+    if (pos < text.size() && text[pos] == '"') {
+      name = string();
+      if (!name.has_value()) {
+        return std::nullopt;
+      }
+    } else if (eat("(")) {
+      key = pipe();
+      if (key.has_value() && !eat(")")) {
+        return fail("expected ')'");
+      }
+      if (!key.has_value()) {
+        return std::nullopt;
+      }
+    } else {
+      auto ident = identifier();
+      if (ident.empty()) {
+        return fail("expected an object key");
+      }
+      name = std::string(ident);
+    }
+
+    // {name} is short for {name: .name}
+    std::optional<Query::Step> value;
+    if (eat(":")) {
+      value = disjunction();
+      if (!value.has_value()) {
+        return std::nullopt;
+      }
+    } else if (name.has_value()) {
+      value = query_field(*name);
+    } else {
+      return fail("expected ':'");
+    }
+    if (name.has_value()) {
+      key = query_literal(JSONObject{JSONString(*name)});
+    }
+    entries.emplace_back(std::move(*key), std::move(*value));
+
+    if (eat("}")) {
+      return query_object(std::move(entries));
+    }
+    if (!eat(",")) {
+      return fail("expected ',' or '}'");
+    }
+  }
+}
+
+inline std::optional<std::string> QueryParser::string() {
+  size_t length = skip_value(text.substr(pos));
+  auto [str, eaten] = parse(text.substr(pos, length));
+  if (eaten == 0 || !str.is_string()) {
+    return fail("bad string");
+  }
+  pos += length;
+  return std::string(str.str());
+}
+
+inline bool QueryParser::eat(std::string_view token) {
+  while (pos < text.size() &&
+         std::isspace(static_cast<unsigned char>(text[pos]))) {
+    ++pos;
+  }
+  if (text.compare(pos, token.size(), token) != 0) {
+    return false;
+  }
+  pos += token.size();
+  return true;
+}
+
+inline bool QueryParser::eat_word(std::string_view word) {
+  size_t start = pos;
+  eat("");
+  if (identifier() == word) {
+    return true;
+  }
+  pos = start;
+  return false;
+}
+
+inline std::string_view QueryParser::identifier() {
+  auto word = [](char ch, bool first) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+           ch == '_' || (!first && ch >= '0' && ch <= '9');
+  };
+  size_t start = pos;
+  while (pos < text.size() && word(text[pos], pos == start)) {
+    ++pos;
+  }
+  return text.substr(start, pos - start);
+}
+
+inline std::nullopt_t QueryParser::fail(std::string message) {
+  if (error.empty()) {
+    error = std::move(message) + " at offset " + std::to_string(pos);
+  }
+  return std::nullopt;
+}
+
+inline Query::Step query_identity() {
+  return {[](JSONObject const &in, Query::Emit const &emit, std::string &) {
+            return emit(in);
+          },
+          [](std::optional<Query::Path> const &in, std::vector<Query::Path> &) {
+            return in;
+          }};
+}
+
+inline Query::Step query_literal(JSONObject value) {
+  return {[value](JSONObject const &, Query::Emit const &emit,
+                  std::string &) { return emit(value); },
+          [](std::optional<Query::Path> const &, std::vector<Query::Path> &)
+              -> std::optional<Query::Path> { return std::nullopt; }};
+}
+
+inline Query::Step query_field(std::string name) {
+  return {[name](JSONObject const &in, Query::Emit const &emit,
+                 std::string &error) {
+            int kind = query_kind(in);
+            if (kind == 0) {
+              return emit(JSONObject{nullptr});
+            }
+            if (kind != 6) {
+              error = std::string("cannot index ") + query_kind_name(in) +
+                      " with \"" + name + "\"";
+              return false;
+            }
+            JSONObject const *found = in.find(name);
+            return found ? emit(*found) : emit(JSONObject{nullptr});
+          },
+          [name](std::optional<Query::Path> const &in,
+                 std::vector<Query::Path> &) -> std::optional<Query::Path> {
+            if (!in.has_value()) {
+              return std::nullopt;
+            }
+            Query::Path path = *in;
+            path.push_back(name);
+            return path;
+          }};
+}
+
+inline Query::Step query_index(Query::Step index) {
+  return {[index](JSONObject const &in, Query::Emit const &emit,
+                  std::string &error) {
+            return index.run(
+                in,
+                [&](JSONObject const &key) {
+                  int kind = query_kind(in);
+                  auto num = query_number(key);
+                  if (kind == 0) {
+                    return emit(JSONObject{nullptr});
+                  }
+                  if (kind == 6 && key.is_string()) {
+                    JSONObject const *found = in.find(key.str());
+                    return found ? emit(*found) : emit(JSONObject{nullptr});
+                  }
+                  if (kind == 5 && num.has_value()) {
+                    // Negative indexes count from the end
+                    auto size = static_cast<double>(in.size());
+                    double at = std::floor(*num < 0 ? *num + size : *num);
+                    if (at < 0 || at >= size) {
+                      return emit(JSONObject{nullptr});
+                    }
+                    auto k = static_cast<size_t>(at);
+                    if (auto list = std::get_if<JSONLIST>(
+                            &in.resolved().inner)) {
+                      return emit((*list)[k]);
+                    }
+                    return emit(in.at(k));
+                  }
+                  error = std::string("cannot index ") +
+                          query_kind_name(in) + " with " +
+                          query_kind_name(key);
+                  return false;
+                },
+                error);
+          },
+          [index](std::optional<Query::Path> const &in,
+                  std::vector<Query::Path> &needs)
+              -> std::optional<Query::Path> {
+            query_materialize(in, needs);
+            query_materialize(index.reads(in, needs), needs);
+            return std::nullopt;
+          }};
+}
+
+inline Query::Step query_iterate() {
+  return {[](JSONObject const &in, Query::Emit const &emit,
+             std::string &error) { return query_each(in, emit, error); },
+          [](std::optional<Query::Path> const &in,
+             std::vector<Query::Path> &needs) -> std::optional<Query::Path> {
+            query_materialize(in, needs);
+            return std::nullopt;
+          }};
+}
+
+inline Query::Step query_optional(Query::Step inner) {
+  // Errors of the inner filter are dropped, but not those of the filters
+  // its outputs are passed on to
+  return {[inner](JSONObject const &in, Query::Emit const &emit,
+                  std::string &error) {
+            bool downstream = false;
+            bool ok = inner.run(
+                in,
+                [&](JSONObject const &val) {
+                  downstream = !emit(val);
+                  return !downstream;
+                },
+                error);
+            if (ok || downstream) {
+              return ok;
+            }
+            error.clear();
+            return true;
+          },
+          inner.reads};
+}
+
+inline Query::Step query_pipe(Query::Step a, Query::Step b) {
+  return {[a, b](JSONObject const &in, Query::Emit const &emit,
+                 std::string &error) {
+            return a.run(
+                in,
+                [&](JSONObject const &val) { return b.run(val, emit, error); },
+                error);
+          },
+          [a, b](std::optional<Query::Path> const &in,
+                 std::vector<Query::Path> &needs) {
+            return b.reads(a.reads(in, needs), needs);
+          }};
+}
+
+inline Query::Step query_comma(Query::Step a, Query::Step b) {
+  return {[a, b](JSONObject const &in, Query::Emit const &emit,
+                 std::string &error) {
+            return a.run(in, emit, error) && b.run(in, emit, error);
+          },
+          [a, b](std::optional<Query::Path> const &in,
+                 std::vector<Query::Path> &needs)
+              -> std::optional<Query::Path> {
+            query_materialize(a.reads(in, needs), needs);
+            query_materialize(b.reads(in, needs), needs);
+            return std::nullopt;
+          }};
+}
+
+inline Query::Step query_binary(std::string op, Query::Step a, Query::Step b) {
+  // Like jq, every output of a is combined with each output of b in turn
+  return {[op, a, b](JSONObject const &in, Query::Emit const &emit,
+                     std::string &error) {
+            return b.run(
+                in,
+                [&](JSONObject const &rhs) {
+                  return a.run(
+                      in,
+                      [&](JSONObject const &lhs) {
+                        if (op.size() == 1 && op != "<" && op != ">") {
+                          JSONObject res{nullptr};
+                          return query_arith(op[0], lhs, rhs, res, error) &&
+                                 emit(res);
+                        }
+                        int order = query_compare(lhs, rhs);
+                        bool res = op == "==" ? order == 0
+                                   : op == "!=" ? order != 0
+                                   : op == "<"  ? order < 0
+                                   : op == "<=" ? order <= 0
+                                   : op == ">"  ? order > 0
+                                                : order >= 0;
+                        return emit(JSONObject{res});
+                      },
+                      error);
+                },
+                error);
+          },
+          [a, b](std::optional<Query::Path> const &in,
+                 std::vector<Query::Path> &needs)
+              -> std::optional<Query::Path> {
+            query_materialize(a.reads(in, needs), needs);
+            query_materialize(b.reads(in, needs), needs);
+            return std::nullopt;
+          }};
+}
+
+inline Query::Step query_logic(bool is_and, Query::Step a, Query::Step b) {
+  // b is only evaluated when a does not decide the result
+  return {[is_and, a, b](JSONObject const &in, Query::Emit const &emit,
+                         std::string &error) {
+            return a.run(
+                in,
+                [&](JSONObject const &lhs) {
+                  if (query_truthy(lhs) != is_and) {
+                    return emit(JSONObject{!is_and});
+                  }
+                  return b.run(
+                      in,
+                      [&](JSONObject const &rhs) {
+                        return emit(JSONObject{query_truthy(rhs)});
+                      },
+                      error);
+                },
+                error);
+          },
+          [a, b](std::optional<Query::Path> const &in,
+                 std::vector<Query::Path> &needs)
+              -> std::optional<Query::Path> {
+            query_materialize(a.reads(in, needs), needs);
+            query_materialize(b.reads(in, needs), needs);
+            return std::nullopt;
+          }};
+}
+
+inline Query::Step query_alternative(Query::Step a, Query::Step b) {
+  // The outputs of a other than null and false, or else those of b. Errors
+  // in a count as no output.
+  return {[a, b](JSONObject const &in, Query::Emit const &emit,
+                 std::string &error) {
+            bool any = false, downstream = false;
+            bool ok = a.run(
+                in,
+                [&](JSONObject const &val) {
+                  if (!query_truthy(val)) {
+                    return true;
+                  }
+                  any = true;
+                  downstream = !emit(val);
+                  return !downstream;
+                },
+                error);
+            if (downstream) {
+              return false;
+            }
+            if (!ok) {
+              error.clear();
+            }
+            return any || b.run(in, emit, error);
+          },
+          [a, b](std::optional<Query::Path> const &in,
+                 std::vector<Query::Path> &needs)
+              -> std::optional<Query::Path> {
+            query_materialize(a.reads(in, needs), needs);
+            query_materialize(b.reads(in, needs), needs);
+            return std::nullopt;
+          }};
+}
+
+inline Query::Step query_array(Query::Step inner) {
+  return {[inner](JSONObject const &in, Query::Emit const &emit,
+                  std::string &error) {
+            JSONLIST list;
+            bool ok = inner.run(
+                in,
+                [&list](JSONObject const &val) {
+                  list.push_back(val);
+                  return true;
+                },
+                error);
+            return ok && emit(JSONObject{std::move(list)});
+          },
+          [inner](std::optional<Query::Path> const &in,
+                  std::vector<Query::Path> &needs)
+              -> std::optional<Query::Path> {
+            query_materialize(inner.reads(in, needs), needs);
+            return std::nullopt;
+          }};
+}
+
+inline Query::Step
+query_object(std::vector<std::pair<Query::Step, Query::Step>> entries) {
+  using Members = std::vector<std::pair<std::string, JSONObject>>;
+
+  // Every combination of the outputs of the keys and values makes one
+  // object, so members are chosen one entry at a time
+  auto run = [entries](JSONObject const &in, Query::Emit const &emit,
+                       std::string &error) {
+    Members members;
+    auto next = [&](size_t k, auto &self) -> bool {
+      if (k == entries.size()) {
+        JSONDICT dict;
+        dict.reserve(members.size());
+        for (auto const &[key, val] : members) {
+          query_set(dict, key, val);
+        }
+        return emit(JSONObject{std::move(dict)});
+      }
+      return entries[k].first.run(
+          in,
+          [&](JSONObject const &key) {
+            if (!key.is_string()) {
+              error = std::string("object keys must be strings, not ") +
+                      query_kind_name(key);
+              return false;
+            }
+            return entries[k].second.run(
+                in,
+                [&](JSONObject const &val) {
+                  members.emplace_back(key.str(), val);
+                  bool ok = self(k + 1, self);
+                  members.pop_back();
+                  return ok;
+                },
+                error);
+          },
+          error);
+    };
+    return next(0, next);
+  };
+  return {run,
+          [entries](std::optional<Query::Path> const &in,
+                    std::vector<Query::Path> &needs)
+              -> std::optional<Query::Path> {
+            for (auto const &[key, val] : entries) {
+              query_materialize(key.reads(in, needs), needs);
+              query_materialize(val.reads(in, needs), needs);
+            }
+            return std::nullopt;
+          }};
+}
+
+inline Query::Step query_select(Query::Step cond) {
+  return {[cond](JSONObject const &in, Query::Emit const &emit,
+                 std::string &error) {
+            return cond.run(
+                in,
+                [&](JSONObject const &val) {
+                  return !query_truthy(val) || emit(in);
+                },
+                error);
+          },
+          // The input passes through, so later steps may read below it
+          [cond](std::optional<Query::Path> const &in,
+                 std::vector<Query::Path> &needs) {
+            query_materialize(cond.reads(in, needs), needs);
+            return in;
+          }};
+}
+
+inline std::optional<Query::Step> query_builtin(std::string_view name) {
+  Query::Filter run;
+  if (name == "length") {
+    run = [](JSONObject const &in, Query::Emit const &emit,
+             std::string &error) {
+      int kind = query_kind(in);
+      if (kind == 1 || kind == 2) {
+        error = "boolean has no length";
+        return false;
+      }
+      if (kind == 3) {
+        return emit(JSONObject{std::fabs(*query_number(in))});
+      }
+      size_t length = in.size();
+      if (kind == 4) {
+        // Code points, so UTF-8 continuation bytes are not counted
+        length = 0;
+        for (char ch : in.str()) {
+          length += (static_cast<unsigned char>(ch) & 0xc0) != 0x80;
+        }
+      }
+      return emit(JSONObject{static_cast<double>(length)});
+    };
+  } else if (name == "keys") {
+    run = [](JSONObject const &in, Query::Emit const &emit,
+             std::string &error) {
+      int kind = query_kind(in);
+      JSONLIST keys;
+      if (kind == 5) {
+        for (size_t k = 0; k < in.size(); ++k) {
+          keys.push_back(JSONObject{static_cast<double>(k)});
+        }
+      } else if (kind == 6) {
+        std::vector<std::string_view> names;
+        query_members(in, [&names](std::string_view key, JSONObject const &) {
+          names.push_back(key);
+          return true;
+        });
+        std::sort(names.begin(), names.end());
+        for (auto key : names) {
+          keys.push_back(JSONObject{JSONString(key)});
+        }
+      } else {
+        error = std::string(query_kind_name(in)) + " has no keys";
+        return false;
+      }
+      return emit(JSONObject{std::move(keys)});
+    };
+  } else if (name == "add") {
+    run = [](JSONObject const &in, Query::Emit const &emit,
+             std::string &error) {
+      JSONObject total{nullptr};
+      bool ok = query_each(
+          in,
+          [&](JSONObject const &val) {
+            JSONObject res{nullptr};
+            if (!query_arith('+', total, val, res, error)) {
+              return false;
+            }
+            total = std::move(res);
+            return true;
+          },
+          error);
+      return ok && emit(total);
+    };
+  } else if (name == "not") {
+    run = [](JSONObject const &in, Query::Emit const &emit, std::string &) {
+      return emit(JSONObject{!query_truthy(in)});
+    };
+  } else if (name == "empty") {
+    return Query::Step{
+        [](JSONObject const &, Query::Emit const &, std::string &) {
+          return true;
+        },
+        [](std::optional<Query::Path> const &, std::vector<Query::Path> &)
+            -> std::optional<Query::Path> { return std::nullopt; }};
+  } else {
+    return std::nullopt;
+  }
+  return Query::Step{
+      run,
+      [](std::optional<Query::Path> const &in,
+         std::vector<Query::Path> &needs) -> std::optional<Query::Path> {
+        query_materialize(in, needs);
+        return std::nullopt;
+      }};
+}
+
+inline void query_materialize(std::optional<Query::Path> const &path,
+                              std::vector<Query::Path> &needs) {
+  if (path.has_value()) {
+    needs.push_back(*path);
+  }
+}
+
+inline int query_kind(JSONObject const &val) {
+  return std::visit(
+      [](auto const &v) -> int {
+        using T = std::decay_t<decltype(v)>;
+        if constexpr (std::is_same_v<T, std::nullptr_t>) {
+          return 0;
+        } else if constexpr (std::is_same_v<T, bool>) {
+          return v ? 2 : 1;
+        } else if constexpr (std::is_same_v<T, int> ||
+                             std::is_same_v<T, double> ||
+                             std::is_same_v<T, JSONNumber> ||
+                             std::is_same_v<T, JSONDecimal>) {
+          return 3;
+        } else if constexpr (std::is_same_v<T, JSONString> ||
+                             std::is_same_v<T, JSONInterned> ||
+                             std::is_same_v<T, JSONSlice>) {
+          return 4;
+        } else if constexpr (std::is_same_v<T, JSONLIST> ||
+                             std::is_same_v<T, JSONINTS> ||
+                             std::is_same_v<T, JSONDOUBLES>) {
+          return 5;
+        } else if constexpr (std::is_same_v<T, JSONLAZY>) {
+          return query_kind(v->get());
+        } else {
+          return 6;
+        }
+      },
+      val.inner);
+}
+
+inline char const *query_kind_name(JSONObject const &val) {
+  constexpr char const *names[] = {"null",   "boolean", "boolean", "number",
+                                   "string", "array",   "object"};
+  return names[query_kind(val)];
+}
+
+inline int query_compare(JSONObject const &a, JSONObject const &b) {
+  int kind = query_kind(a);
+  if (int other = query_kind(b); kind != other) {
+    return kind < other ? -1 : 1;
+  }
+  if (kind == 3) {
+    double x = *query_number(a), y = *query_number(b);
+    return (x > y) - (x < y);
+  }
+  if (kind == 4) {
+    int order = a.str().compare(b.str());
+    return (order > 0) - (order < 0);
+  }
+  if (kind == 5) {
+    size_t size = std::min(a.size(), b.size());
+    for (size_t k = 0; k < size; ++k) {
+      if (int order = query_compare(a.at(k), b.at(k))) {
+        return order;
+      }
+    }
+    return (a.size() > b.size()) - (a.size() < b.size());
+  }
+  if (kind == 6) {
+    // Sorted keys first, then the values in the order of their keys
+    using Members =
+        std::vector<std::pair<std::string_view, JSONObject const *>>;
+    auto sorted = [](JSONObject const &obj) {
+      Members members;
+      query_members(obj, [&members](std::string_view key,
+                                    JSONObject const &val) {
+        members.emplace_back(key, &val);
+        return true;
+      });
+      std::sort(members.begin(), members.end());
+      return members;
+    };
+    Members x = sorted(a), y = sorted(b);
+    auto key_less = [](auto const &l, auto const &r) {
+      return l.first < r.first;
+    };
+    if (std::lexicographical_compare(x.begin(), x.end(), y.begin(), y.end(),
+                                     key_less)) {
+      return -1;
+    }
+    if (std::lexicographical_compare(y.begin(), y.end(), x.begin(), x.end(),
+                                     key_less)) {
+      return 1;
+    }
+    for (size_t k = 0; k < x.size(); ++k) {
+      if (int order = query_compare(*x[k].second, *y[k].second)) {
+        return order;
+      }
+    }
+  }
+  return 0;
+}
+
+inline bool query_truthy(JSONObject const &val) { return query_kind(val) >= 2; }
+
+inline std::optional<double> query_number(JSONObject const &value) {
+  JSONObject const &val = value.resolved();
+  if (auto n = std::get_if<int>(&val.inner)) {
+    return *n;
+  }
+  if (auto d = std::get_if<double>(&val.inner)) {
+    return *d;
+  }
+  if (auto dec = std::get_if<JSONDecimal>(&val.inner)) {
+    return dec->to_double();
+  }
+  if (auto num = std::get_if<JSONNumber>(&val.inner)) {
+    return query_number(num->value());
+  }
+  return std::nullopt;
+}
+
+template <class F> bool query_members(JSONObject const &obj, F &&f) {
+  JSONObject const &val = obj.resolved();
+  if (auto dict = std::get_if<JSONDICT>(&val.inner)) {
+    for (auto const &[key, member] : *dict) {
+      if (!f(std::string_view(key), member)) {
+        return false;
+      }
+    }
+  } else if (auto rec = std::get_if<JSONRecord>(&val.inner)) {
+    for (size_t k = 0; k < rec->values.size(); ++k) {
+      if (!f(std::string_view(rec->shape->keys[k]), rec->values[k])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+inline bool query_each(JSONObject const &value, Query::Emit const &emit,
+                       std::string &error) {
+  JSONObject const &val = value.resolved();
+  int kind = query_kind(val);
+  if (auto list = std::get_if<JSONLIST>(&val.inner)) {
+    for (auto const &member : *list) {
+      if (!emit(member)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  if (kind == 5) {
+    for (size_t k = 0; k < val.size(); ++k) {
+      if (!emit(val.at(k))) {
+        return false;
+      }
+    }
+    return true;
+  }
+  if (kind == 6) {
+    return query_members(val, [&emit](std::string_view,
+                                      JSONObject const &member) {
+      return emit(member);
+    });
+  }
+  error = std::string("cannot iterate over ") + query_kind_name(val);
+  return false;
+}
+
+inline bool query_arith(char op, JSONObject const &a, JSONObject const &b,
+                        JSONObject &res, std::string &error) {
+  int kind = query_kind(a), other = query_kind(b);
+  if (op == '+' && (kind == 0 || other == 0)) {
+    res = kind == 0 ? b : a;
+    return true;
+  }
+
+  if (kind == 3 && other == 3) {
+    double x = *query_number(a), y = *query_number(b);
+    if ((op == '/' || op == '%') && y == 0) {
+      error = "cannot divide by zero";
+      return false;
+    }
+    switch (op) {
+    case '+':
+      res = JSONObject{x + y};
+      break;
+    case '-':
+      res = JSONObject{x - y};
+      break;
+    case '*':
+      res = JSONObject{x * y};
+      break;
+    case '/':
+      res = JSONObject{x / y};
+      break;
+    default: {
+      // Like jq, % works on the integer parts
+      auto n = static_cast<int64_t>(x), d = static_cast<int64_t>(y);
+      if (d == 0) {
+        error = "cannot divide by zero";
+        return false;
+      }
+      res = JSONObject{static_cast<double>(n % d)};
+    }
+    }
+    return true;
+  }
+
+  if (op == '+' && kind == other && kind == 4) {
+    JSONString str(a.str());
+    str += b.str();
+    res = JSONObject{std::move(str)};
+    return true;
+  }
+  if ((op == '+' || op == '-') && kind == other && kind == 5) {
+    JSONLIST list;
+    for (size_t k = 0; k < a.size(); ++k) {
+      JSONObject member = a.at(k);
+      bool dropped = false;
+      for (size_t j = 0; op == '-' && !dropped && j < b.size(); ++j) {
+        dropped = query_compare(member, b.at(j)) == 0;
+      }
+      if (!dropped) {
+        list.push_back(std::move(member));
+      }
+    }
+    for (size_t k = 0; op == '+' && k < b.size(); ++k) {
+      list.push_back(b.at(k));
+    }
+    res = JSONObject{std::move(list)};
+    return true;
+  }
+  if (op == '+' && kind == other && kind == 6) {
+    JSONDICT dict;
+    auto put = [&dict](std::string_view key, JSONObject const &val) {
+      query_set(dict, key, val);
+      return true;
+    };
+    query_members(a, put);
+    query_members(b, put);
+    res = JSONObject{std::move(dict)};
+    return true;
+  }
+
+  error = std::string(query_kind_name(a)) + " and " + query_kind_name(b) +
+          " cannot be combined with " + op;
+  return false;
+}
+
+inline void query_set(JSONDICT &dict, std::string_view key, JSONObject value) {
+  auto it = dict.find(key);
+  if (it != dict.end()) {
+    it->second = std::move(value);
+  } else {
+    dict.try_emplace(JSONString(key), std::move(value));
+  }
+}
+
+inline std::optional<std::vector<std::string_view>>
+value_spans(std::string_view json, bool each) {
+  std::vector<std::string_view> spans;
+  size_t pos = 0;
+  for (;;) {
+    pos = std::min(json.find_first_not_of(" \n\r\t\v\f\x1e", pos),
+                   json.size());
+    if (pos == json.size()) {
+      return spans;
+    }
+    size_t length = skip_value(json.substr(pos));
+    if (length == 0) {
+      return std::nullopt;
+    }
+    std::string_view span = json.substr(pos, length);
+    if (each && span[0] == '[') {
+      if (split_members(span, spans) == 0) {
+        return std::nullopt;
+      }
+    } else {
+      spans.push_back(span);
+    }
+    pos += length;
+  }
+}
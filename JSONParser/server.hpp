@@ -0,0 +1,221 @@
+#pragma once
+
+#include "columns.hpp"
+#include "index.hpp"
+#include "persistent.hpp"
+#include "writer.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Documents parsed once and queried over a Unix socket. Every line sent is
+// one request and gets one line back, "ok" and JSON or "err" and a reason:
+//   get DOC [PATH]                        value at a pointer or dotted path
+//   agg DOC VERB [-f FIELD] [-g GROUP]    aggregate over the records of DOC
+//   set DOC POINTER JSON                  replace a value in DOC
+// Requests read a lock-free snapshot of their document, so they never wait
+// for a set, and sets never wait for a request to finish with its snapshot.
+struct Server {
+  std::map<std::string, VersionedJSON> docs{};
+
+  // Keep a JSON file, or the records of an NDJSON file, under its path;
+  // false when the file cannot be read or holds invalid JSON
+  bool load(std::string const &path, unsigned jobs);
+
+  std::string answer(std::string_view request);
+
+  // Accept connections on jobs threads that each serve one connection at a
+  // time. Only returns when the socket cannot be set up or accept fails.
+  void serve(std::string const &socket_path, unsigned jobs);
+
+  void handle(int conn);
+};
+
+inline bool Server::load(std::string const &path, unsigned jobs) {
+  MappedFile file(path);
+  if (!file.opened) {
+    return false;
+  }
+  std::string_view text = file.view();
+  auto [obj, eaten] = parse_parallel(text, jobs);
+
+  // A file holding more than one value is read as NDJSON records
+  if (eaten == 0 ||
+      text.find_first_not_of(" \n\r\t\v\f", eaten) != text.npos) {
+    JSONLIST records;
+    size_t from = 0;
+    while (auto line = next_record(text, from)) {
+      auto [record, used] = parse(*line);
+      if (used == 0) {
+        return false;
+      }
+      records.push_back(std::move(record));
+    }
+    obj = JSONObject{std::move(records)};
+  }
+  docs[path].store(to_persistent(obj));
+  return true;
+}
+
+inline std::string Server::answer(std::string_view request) {
+  auto word = [&request] {
+    size_t end = std::min(request.find(' '), request.size());
+    std::string_view head = request.substr(0, end);
+    request.remove_prefix(std::min(end + 1, request.size()));
+    return head;
+  };
+
+  std::string_view kind = word();
+  auto found = docs.find(std::string(word()));
+  if (found == docs.end()) {
+    return "err unknown document";
+  }
+  PersistentJSON doc = found->second.snapshot();
+  std::string out = "ok ";
+
+  if (kind == "get") {
+    auto tokens = split_path(request);
+    PValue node = tokens.has_value() ? doc.find(*tokens) : nullptr;
+    if (!node) {
+      return "err no value at path";
+    }
+    dump(*node, out);
+    return out;
+  }
+
+  if (kind == "set") {
+    std::string_view pointer = word();
+    auto [value, eaten] = parse(request);
+    if (eaten == 0 || !found->second.set(pointer, value)) {
+      return "err invalid edit";
+    }
+    return "ok";
+  }
+
+  if (kind == "agg") {
+    std::string_view verb = word();
+    std::string_view field, group_by;
+    while (!request.empty()) {
+      std::string_view flag = word();
+      if (flag == "-f") {
+        field = word();
+      } else if (flag == "-g") {
+        group_by = word();
+      } else {
+        return "err unknown option";
+      }
+    }
+    auto list = std::get_if<PList>(&doc.root->inner);
+    if (!list) {
+      return "err document is not an array";
+    }
+    if (verb != "count" && verb != "sum" && verb != "min" && verb != "max" &&
+        verb != "avg") {
+      return "err unknown verb";
+    }
+    auto result = aggregate_records(
+        list->size, verb, field, group_by, 1,
+        [list](size_t k, std::vector<std::string> const &tokens)
+            -> std::optional<JSONObject> {
+          PValue node = PersistentJSON{list->at(k)}.find(tokens);
+          if (!node) {
+            return std::nullopt;
+          }
+          return from_persistent(*node);
+        });
+    if (!result.has_value()) {
+      return "err invalid field path";
+    }
+    return out + *result;
+  }
+
+  return "err unknown request";
+}
+
+inline void Server::serve(std::string const &socket_path, unsigned jobs) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    return;
+  }
+  std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+  // A socket left behind by an earlier server would make bind fail
+  struct stat st {};
+  if (lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(socket_path.c_str());
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return;
+  }
+  if (bind(fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return;
+  }
+
+  // Clients that hang up before reading their answer must not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<std::thread> workers;
+  for (unsigned w = 0; w < std::max(jobs, 1u); ++w) {
+    workers.emplace_back([this, fd] {
+      for (;;) {
+        int conn = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn >= 0) {
+          handle(conn);
+          close(conn);
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+          return;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  close(fd);
+}
+
+inline void Server::handle(int conn) {
+  std::string pending;
+  char buf[1 << 16];
+  for (;;) {
+    ssize_t got = read(conn, buf, sizeof(buf));
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return;
+    }
+    pending.append(buf, static_cast<size_t>(got));
+
+    // Answer every complete line and keep the rest for the next read
+    std::string replies;
+    size_t begin = 0;
+    for (size_t end; (end = pending.find('\n', begin)) != pending.npos;
+         begin = end + 1) {
+      replies += answer(std::string_view(pending).substr(begin, end - begin));
+      replies += '\n';
+    }
+    pending.erase(0, begin);
+    if (!replies.empty() && !write_pieces(conn, {replies})) {
+      return;
+    }
+  }
+}
@@ -0,0 +1,13 @@
+// Included again by all_headers_again.cpp: a definition in a header that is
+// missing its inline makes the two fail to link
+#include "bench.hpp"
+#include "columns.hpp"
+#include "index.hpp"
+#include "json.hpp"
+#include "memory.hpp"
+#include "persistent.hpp"
+#include "query.hpp"
+#include "server.hpp"
+#include "writer.hpp"
+
+int main() { return 0; }
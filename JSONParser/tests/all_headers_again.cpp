@@ -0,0 +1,9 @@
+#include "bench.hpp"
+#include "columns.hpp"
+#include "index.hpp"
+#include "json.hpp"
+#include "memory.hpp"
+#include "persistent.hpp"
+#include "query.hpp"
+#include "server.hpp"
+#include "writer.hpp"
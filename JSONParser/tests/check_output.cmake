@@ -0,0 +1,35 @@
+# Run PARSER with ARGS, whose items are separated by "@@", in the FIXTURES
+# directory and compare what it prints with the EXPECTED file. With STDIN
+# the file is piped to it, so it reads a stream that cannot be sized. With
+# FAILS it must exit with an error and what it reports is compared instead.
+
+string(REPLACE "@@" ";" args "${ARGS}")
+if(STDIN)
+  execute_process(
+    COMMAND ${CMAKE_COMMAND} -E cat ${STDIN}
+    COMMAND ${PARSER} ${args}
+    WORKING_DIRECTORY ${FIXTURES}
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE error
+    RESULT_VARIABLE result)
+else()
+  execute_process(
+    COMMAND ${PARSER} ${args}
+    WORKING_DIRECTORY ${FIXTURES}
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE error
+    RESULT_VARIABLE result)
+endif()
+
+if(FAILS)
+  if(result EQUAL 0)
+    message(FATAL_ERROR "${PARSER} succeeded and printed: ${output}")
+  endif()
+  set(output "${error}")
+elseif(NOT result EQUAL 0)
+  message(FATAL_ERROR "${PARSER} exited with ${result}: ${error}")
+endif()
+file(READ ${EXPECTED} expected)
+if(NOT output STREQUAL expected)
+  message(FATAL_ERROR "Expected:\n${expected}\nGot:\n${output}")
+endif()
@@ -0,0 +1,28 @@
+// Parse every record of a file with one Parser, which keeps its arena and
+// record shapes from one message to the next, and print each as JSON:
+//   parse_messages FILE
+#include "memory.hpp"
+#include "writer.hpp"
+#include <iostream>
+#include <string>
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    std::cerr << "usage: parse_messages FILE";
+    return 1;
+  }
+
+  PageBuffer input = read_file(argv[1], false);
+  Parser parser;
+  for (auto msg : record_spans(input.view())) {
+    auto [doc, eaten] = parser.parse(msg);
+    if (eaten == 0) {
+      std::cerr << "Invalid JSON.";
+      return 1;
+    }
+    std::string out;
+    dump(doc, out);
+    std::cout << out << "\n";
+  }
+  return 0;
+}
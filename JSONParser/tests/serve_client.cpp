@@ -0,0 +1,96 @@
+// Start json_parser serve on a socket in a fresh directory, send it the
+// requests read from stdin over one connection and print the replies, so
+// serve can be checked like the other commands:
+//   serve_client PARSER FILE...
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "usage: serve_client PARSER FILE...";
+    return 1;
+  }
+
+  char dir[] = "/tmp/json-serve-XXXXXX";
+  if (!mkdtemp(dir)) {
+    std::cerr << "Failed to make a socket directory.";
+    return 1;
+  }
+  std::string socket_path = std::string(dir) + "/sock";
+
+  std::vector<char *> args{argv[1], const_cast<char *>("serve"),
+                           const_cast<char *>("-s"), socket_path.data()};
+  args.insert(args.end(), argv + 2, argv + argc);
+  args.push_back(nullptr);
+  pid_t server = fork();
+  if (server == 0) {
+    execv(argv[1], args.data());
+    _exit(127);
+  }
+
+  // The server parses its files before it listens, so retry for a while
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+  int fd = -1;
+  bool exited = false;
+  for (int tries = 0; fd < 0 && !exited && tries < 500; ++tries) {
+    exited = waitpid(server, nullptr, WNOHANG) == server;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) !=
+        0) {
+      close(fd);
+      fd = -1;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  int status = 1;
+  if (fd >= 0) {
+    std::string requests{std::istreambuf_iterator<char>(std::cin), {}};
+    size_t lines = 0;
+    for (char ch : requests) {
+      lines += ch == '\n';
+    }
+    std::string replies;
+    bool sent = write(fd, requests.data(), requests.size()) ==
+                static_cast<ssize_t>(requests.size());
+    char buf[1 << 12];
+    size_t seen = 0;
+    while (sent && seen < lines) {
+      ssize_t got = read(fd, buf, sizeof(buf));
+      if (got <= 0) {
+        break;
+      }
+      for (ssize_t i = 0; i < got; ++i) {
+        seen += buf[i] == '\n';
+      }
+      replies.append(buf, static_cast<size_t>(got));
+    }
+    close(fd);
+    std::cout << replies;
+    status = seen == lines ? 0 : 1;
+  } else {
+    std::cerr << "Failed to connect to the server.";
+  }
+
+  if (!exited) {
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+  }
+  unlink(socket_path.c_str());
+  rmdir(dir);
+  return status;
+}
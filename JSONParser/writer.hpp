@@ -0,0 +1,700 @@
+#pragma once
+
+#include "json.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Writes JSON text as it is produced instead of from a tree. Text collects
+// in a buffer that is written to fd whenever it grows past flush_size, so
+// memory stays bounded; without an fd the caller takes the buffer. Calls in
+// the wrong order are caught by asserts in debug builds only.
+struct JSONWriter {
+  explicit JSONWriter(int fd_ = -1, size_t flush_size_ = size_t{1} << 16)
+      : fd(fd_), flush_size(flush_size_) {}
+
+  void begin_object();
+  void end_object();
+  void begin_array();
+  void end_array();
+  void key(std::string_view name);
+
+  void value(std::nullptr_t);
+  void value(bool b);
+  void value(int num);
+  void value(double num);
+  void value(std::string_view str);
+  void value(char const *str) { value(std::string_view(str)); }
+  void value(JSONObject const &obj);
+
+  // End a top-level value with a newline so another can follow, as NDJSON
+  void end_line();
+
+  // Write out the buffer; false once any write to fd has failed
+  bool flush();
+
+  // Separate the next value or key from the one before it
+  void separate();
+  void wrote();
+
+  int fd;
+  size_t flush_size;
+  std::string buffer{};
+  bool comma = false;
+  bool after_key = false;
+  bool failed = false;
+#ifndef NDEBUG
+  std::vector<char> scopes{}; // '{' or '[' for every open container
+#endif
+};
+
+// Append str as a quoted JSON string
+void dump_string(std::string_view str, std::string &out);
+
+template <class T> void dump_number(T num, std::string &out);
+
+// Append the JSON text of obj
+void dump(JSONObject const &obj, std::string &out);
+
+// Member order of every record shape met during one canonical dump, so
+// records sharing a shape are sorted once
+using ShapeOrders =
+    std::unordered_map<JSONShape const *, std::vector<uint32_t>>;
+
+// Append obj as RFC 8785 canonical JSON: no whitespace, members sorted by
+// the UTF-16 code units of their keys and numbers written as ECMAScript
+// doubles. False for numbers beyond the range of double, which have no
+// canonical form.
+bool dump_canonical(JSONObject const &obj, std::string &out);
+bool dump_canonical(JSONObject const &obj, std::string &out,
+                    ShapeOrders &orders);
+
+// The first 8 bytes of a UTF-8 key, remapped so that comparing them as an
+// integer orders keys by UTF-16 code units as far as those bytes tell
+uint64_t canonical_sort_key(std::string_view key);
+
+// A byte of valid UTF-8 remapped so that byte order is UTF-16 code unit
+// order. Only lead bytes move: UTF-16 puts characters past U+FFFF, which
+// start with F0 to F4, between U+D7FF (ED ..) and U+E000 (EE ..).
+unsigned canonical_byte(char ch);
+
+// Whether key a comes before b by UTF-16 code units
+bool canonical_less(std::string_view a, std::string_view b);
+
+// Indexes of the n keys given by key_at in canonical order. Keys are
+// compared by their sort keys, and in full only on ties.
+template <class F> std::vector<uint32_t> canonical_order(size_t n, F &&key_at);
+
+// Serialize obj into ordered pieces, large members on several threads
+void dump_parallel(JSONObject const &obj, unsigned jobs,
+                   std::vector<std::string> &pieces);
+
+// Write pieces to fd in order without joining them first
+bool write_pieces(int fd, std::vector<std::string> const &pieces);
+
+// Text records are indexed and looked up by: the value as JSON, so that
+// strings keep their quotes and true never matches "true"
+std::string key_text(JSONObject const &val);
+
+// Text records are grouped by: strings without their quotes, and other
+// values as JSON, as they become the keys of an object
+std::string group_text(JSONObject const &val);
+
+// Open the output path for writing, or stdout for "" and "-"; -1 on error
+int open_output(std::string const &output);
+
+// Write pieces to the output path, or to stdout for "" and "-"
+bool write_output(std::string const &output,
+                  std::vector<std::string> const &pieces);
+
+// Second character of the escape for each byte: 'u' for \u00XX, or 0 for
+// bytes that are copied as they are
+inline std::array<char, 256> const json_escapes = [] {
+  std::array<char, 256> table{};
+  for (int ch = 0; ch < 0x20; ++ch) {
+    table[static_cast<size_t>(ch)] = 'u';
+  }
+  table['"'] = '"';
+  table['\\'] = '\\';
+  table['\n'] = 'n';
+  table['\r'] = 'r';
+  table['\t'] = 't';
+  table['\b'] = 'b';
+  table['\f'] = 'f';
+  return table;
+}();
+
+inline void dump_string(std::string_view str, std::string &out) {
+  // Copy runs of plain bytes at once and only break them up for escapes
+  out += '"';
+  size_t run = 0;
+  for (size_t i = 0; i < str.size(); ++i) {
+    char esc = json_escapes[static_cast<unsigned char>(str[i])];
+    if (esc == 0) {
+      continue;
+    }
+    out.append(str.substr(run, i - run));
+    out += '\\';
+    out += esc;
+    if (esc == 'u') {
+      constexpr char hex[] = "0123456789abcdef";
+      out += "00";
+      out += hex[(str[i] >> 4) & 0xf];
+      out += hex[str[i] & 0xf];
+    }
+    run = i + 1;
+  }
+  out.append(str.substr(run));
+  out += '"';
+}
+
+template <class T> void dump_number(T num, std::string &out) {
+  if constexpr (std::is_same_v<T, double>) {
+    // JSON has no spelling for inf and nan
+    if (!std::isfinite(num)) {
+      out += "null";
+      return;
+    }
+  }
+  char buf[32];
+  auto res = std::to_chars(buf, buf + sizeof(buf), num);
+  out.append(buf, res.ptr);
+}
+
+inline void dump(JSONObject const &obj, std::string &out) {
+  std::visit(
+      [&out](auto const &val) {
+        using T = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<T, std::nullptr_t>) {
+          out += "null";
+        } else if constexpr (std::is_same_v<T, bool>) {
+          out += val ? "true" : "false";
+        } else if constexpr (std::is_same_v<T, int> ||
+                             std::is_same_v<T, double>) {
+          dump_number(val, out);
+        } else if constexpr (std::is_same_v<T, JSONString>) {
+          dump_string(val, out);
+        } else if constexpr (std::is_same_v<T, JSONInterned>) {
+          dump_string(val.view(), out);
+        } else if constexpr (std::is_same_v<T, JSONSlice>) {
+          dump_string(val.text, out);
+        } else if constexpr (std::is_same_v<T, JSONNumber>) {
+          out += val.text;
+        } else if constexpr (std::is_same_v<T, JSONDecimal>) {
+          val.dump(out);
+        } else if constexpr (std::is_same_v<T, JSONLIST>) {
+          out += '[';
+          for (size_t k = 0; k < val.size(); ++k) {
+            if (k != 0) {
+              out += ',';
+            }
+            dump(val[k], out);
+          }
+          out += ']';
+        } else if constexpr (std::is_same_v<T, JSONINTS> ||
+                             std::is_same_v<T, JSONDOUBLES>) {
+          out += '[';
+          for (size_t k = 0; k < val.size(); ++k) {
+            if (k != 0) {
+              out += ',';
+            }
+            dump_number(val[k], out);
+          }
+          out += ']';
+        } else if constexpr (std::is_same_v<T, JSONRecord>) {
+          out += '{';
+          for (size_t k = 0; k < val.values.size(); ++k) {
+            if (k != 0) {
+              out += ',';
+            }
+            dump_string(val.shape->keys[k], out);
+            out += ':';
+            dump(val.values[k], out);
+          }
+          out += '}';
+        } else if constexpr (std::is_same_v<T, JSONDICT>) {
+          out += '{';
+          bool once = false;
+          for (auto const &[k, v] : val) {
+            if (once) {
+              out += ',';
+            } else {
+              once = true;
+            }
+            dump_string(k, out);
+            out += ':';
+            dump(v, out);
+          }
+          out += '}';
+        } else {
+          dump(val->get(), out);
+        }
+      },
+      obj.inner);
+}
+
+inline bool dump_canonical(JSONObject const &obj, std::string &out) {
+  ShapeOrders orders;
+  return dump_canonical(obj, out, orders);
+}
+
+inline bool dump_canonical(JSONObject const &obj, std::string &out,
+                           ShapeOrders &orders) {
+  return std::visit(
+      [&obj, &out, &orders](auto const &val) -> bool {
+        using T = std::decay_t<decltype(val)>;
+        auto number = [&out](double num) {
+          if (!std::isfinite(num)) {
+            return false;
+          }
+          dump_ecmascript(num, out);
+          return true;
+        };
+        if constexpr (std::is_same_v<T, double>) {
+          return number(val);
+        } else if constexpr (std::is_same_v<T, JSONDecimal>) {
+          return number(val.to_double());
+        } else if constexpr (std::is_same_v<T, JSONNumber>) {
+          return dump_canonical(val.value(), out, orders);
+        } else if constexpr (std::is_same_v<T, JSONDOUBLES>) {
+          out += '[';
+          for (size_t k = 0; k < val.size(); ++k) {
+            if (k != 0) {
+              out += ',';
+            }
+            if (!number(val[k])) {
+              return false;
+            }
+          }
+          out += ']';
+          return true;
+        } else if constexpr (std::is_same_v<T, JSONLIST>) {
+          out += '[';
+          for (size_t k = 0; k < val.size(); ++k) {
+            if (k != 0) {
+              out += ',';
+            }
+            if (!dump_canonical(val[k], out, orders)) {
+              return false;
+            }
+          }
+          out += ']';
+          return true;
+        } else if constexpr (std::is_same_v<T, JSONDICT> ||
+                             std::is_same_v<T, JSONRecord>) {
+          std::vector<uint32_t> own;
+          std::vector<uint32_t> const *order = &own;
+          if constexpr (std::is_same_v<T, JSONDICT>) {
+            own = canonical_order(val.size(), [&val](size_t k) {
+              return std::string_view(val.entries[k].first);
+            });
+          } else {
+            auto [it, added] = orders.try_emplace(val.shape.get());
+            if (added) {
+              it->second =
+                  canonical_order(val.values.size(), [&val](size_t k) {
+                    return std::string_view(val.shape->keys[k]);
+                  });
+            }
+            order = &it->second;
+          }
+          out += '{';
+          for (size_t k = 0; k < order->size(); ++k) {
+            if (k != 0) {
+              out += ',';
+            }
+            uint32_t member = (*order)[k];
+            if constexpr (std::is_same_v<T, JSONDICT>) {
+              dump_string(val.entries[member].first, out);
+              out += ':';
+              if (!dump_canonical(val.entries[member].second, out, orders)) {
+                return false;
+              }
+            } else {
+              dump_string(val.shape->keys[member], out);
+              out += ':';
+              if (!dump_canonical(val.values[member], out, orders)) {
+                return false;
+              }
+            }
+          }
+          out += '}';
+          return true;
+        } else if constexpr (std::is_same_v<T, JSONLAZY>) {
+          return dump_canonical(val->get(), out, orders);
+        } else {
+          // Ints, packed ints, literals and strings are already canonical
+          dump(obj, out);
+          return true;
+        }
+      },
+      obj.inner);
+}
+
+inline unsigned canonical_byte(char ch) {
+  auto byte = static_cast<unsigned char>(ch);
+  if (byte >= 0xf0) {
+    return byte - 2u;
+  }
+  return byte >= 0xee ? byte + 5u : byte;
+}
+
+inline uint64_t canonical_sort_key(std::string_view key) {
+  uint64_t res = 0;
+  for (size_t i = 0; i < 8; ++i) {
+    res = res << 8 | (i < key.size() ? canonical_byte(key[i]) : 0);
+  }
+  return res;
+}
+
+inline bool canonical_less(std::string_view a, std::string_view b) {
+  return std::lexicographical_compare(
+      a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+        return canonical_byte(x) < canonical_byte(y);
+      });
+}
+
+template <class F>
+std::vector<uint32_t> canonical_order(size_t n, F &&key_at) {
+  std::vector<std::pair<uint64_t, uint32_t>> keys(n);
+  for (size_t k = 0; k < n; ++k) {
+    keys[k] = {canonical_sort_key(key_at(k)), static_cast<uint32_t>(k)};
+  }
+  std::sort(keys.begin(), keys.end(), [&key_at](auto const &a, auto const &b) {
+    if (a.first != b.first) {
+      return a.first < b.first;
+    }
+    return canonical_less(key_at(a.second), key_at(b.second));
+  });
+  std::vector<uint32_t> res(n);
+  for (size_t k = 0; k < n; ++k) {
+    res[k] = keys[k].second;
+  }
+  return res;
+}
+
+inline void dump_parallel(JSONObject const &obj, unsigned jobs,
+                          std::vector<std::string> &pieces) {
+  if (std::holds_alternative<JSONLAZY>(obj.inner)) {
+    dump_parallel(obj.resolved(), jobs, pieces);
+    return;
+  }
+
+  auto width = [](JSONObject const &member) -> size_t {
+    return member.size() + 1;
+  };
+
+  // Only containers wide enough to give every thread a share are worth it;
+  // packed arrays hold plain numbers and are written in one go.
+  auto const *dict = std::get_if<JSONDICT>(&obj.inner);
+  auto const *list = std::get_if<JSONLIST>(&obj.inner);
+  if (jobs <= 1 || (!dict && !list) || width(obj) < 2 * size_t{jobs}) {
+    pieces.emplace_back();
+    dump(obj, pieces.back());
+    return;
+  }
+
+  std::vector<JSONDICT::value_type const *> entries;
+  std::vector<JSONObject const *> members;
+  if (dict) {
+    for (auto const &entry : *dict) {
+      entries.push_back(&entry);
+      members.push_back(&entry.second);
+    }
+  } else {
+    for (auto const &member : *list) {
+      members.push_back(&member);
+    }
+  }
+
+  // Members wider than a thread's share are serialized with the whole pool;
+  // runs of the others become tasks, each writing into its own buffer.
+  size_t total = 0;
+  for (auto member : members) {
+    total += width(*member);
+  }
+  size_t share = total / jobs;
+  size_t task_width = std::max<size_t>(total / (jobs * 8), 1);
+
+  struct Task {
+    size_t begin, end;
+    std::string buf;
+  };
+  std::vector<Task> tasks;
+  std::vector<size_t> large;
+  size_t task_begin = 0, task_size = 0;
+  for (size_t k = 0; k < members.size(); ++k) {
+    size_t w = width(*members[k]);
+    if (w > share && w > 1) {
+      if (task_begin != k) {
+        tasks.push_back({task_begin, k, {}});
+      }
+      large.push_back(k);
+      task_begin = k + 1;
+      task_size = 0;
+      continue;
+    }
+    task_size += w;
+    if (task_size >= task_width) {
+      tasks.push_back({task_begin, k + 1, {}});
+      task_begin = k + 1;
+      task_size = 0;
+    }
+  }
+  if (task_begin != members.size()) {
+    tasks.push_back({task_begin, members.size(), {}});
+  }
+
+  auto dump_member = [&](size_t k, std::string &out) {
+    if (dict) {
+      dump_string(entries[k]->first, out);
+      out += ':';
+    }
+    dump(*members[k], out);
+  };
+
+  run_tasks(tasks.size(), jobs, [&](size_t t) {
+    for (size_t k = tasks[t].begin; k < tasks[t].end; ++k) {
+      if (k != tasks[t].begin) {
+        tasks[t].buf += ',';
+      }
+      dump_member(k, tasks[t].buf);
+    }
+  });
+
+  // Stitch task buffers and large members back together in member order
+  pieces.emplace_back(dict ? "{" : "[");
+  auto task = tasks.begin();
+  auto big = large.begin();
+  for (size_t k = 0; k < members.size();) {
+    if (k != 0) {
+      pieces.back() += ',';
+    }
+    if (task != tasks.end() && task->begin == k) {
+      k = task->end;
+      pieces.push_back(std::move(task->buf));
+      ++task;
+    } else {
+      size_t m = *big++;
+      if (dict) {
+        dump_string(entries[m]->first, pieces.back());
+        pieces.back() += ':';
+      }
+      dump_parallel(*members[m], jobs, pieces);
+      k = m + 1;
+    }
+    pieces.emplace_back();
+  }
+  pieces.back() += dict ? '}' : ']';
+}
+
+inline int open_output(std::string const &output) {
+  if (output.empty() || output == "-") {
+    return STDOUT_FILENO;
+  }
+  return open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+inline bool write_output(std::string const &output,
+                         std::vector<std::string> const &pieces) {
+  int fd = open_output(output);
+  if (fd < 0) {
+    return false;
+  }
+  bool written = write_pieces(fd, pieces);
+  return fd == STDOUT_FILENO ? written : close(fd) == 0 && written;
+}
+
+inline void JSONWriter::separate() {
+#ifndef NDEBUG
+  assert(scopes.empty() ? !comma : scopes.back() == '[' || after_key);
+#endif
+  if (after_key) {
+    after_key = false;
+  } else if (comma) {
+    buffer += ',';
+  }
+}
+
+inline void JSONWriter::wrote() {
+  comma = true;
+  if (fd >= 0 && buffer.size() >= flush_size) {
+    flush();
+  }
+}
+
+inline void JSONWriter::begin_object() {
+  separate();
+  buffer += '{';
+  comma = false;
+#ifndef NDEBUG
+  scopes.push_back('{');
+#endif
+}
+
+inline void JSONWriter::end_object() {
+#ifndef NDEBUG
+  assert(!scopes.empty() && scopes.back() == '{' && !after_key);
+  scopes.pop_back();
+#endif
+  buffer += '}';
+  wrote();
+}
+
+inline void JSONWriter::begin_array() {
+  separate();
+  buffer += '[';
+  comma = false;
+#ifndef NDEBUG
+  scopes.push_back('[');
+#endif
+}
+
+inline void JSONWriter::end_array() {
+#ifndef NDEBUG
+  assert(!scopes.empty() && scopes.back() == '[');
+  scopes.pop_back();
+#endif
+  buffer += ']';
+  wrote();
+}
+
+inline void JSONWriter::key(std::string_view name) {
+#ifndef NDEBUG
+  assert(!scopes.empty() && scopes.back() == '{' && !after_key);
+#endif
+  if (comma) {
+    buffer += ',';
+  }
+  dump_string(name, buffer);
+  buffer += ':';
+  after_key = true;
+}
+
+inline void JSONWriter::value(std::nullptr_t) {
+  separate();
+  buffer += "null";
+  wrote();
+}
+
+inline void JSONWriter::value(bool b) {
+  separate();
+  buffer += b ? "true" : "false";
+  wrote();
+}
+
+inline void JSONWriter::value(int num) {
+  separate();
+  dump_number(num, buffer);
+  wrote();
+}
+
+inline void JSONWriter::value(double num) {
+  separate();
+  dump_number(num, buffer);
+  wrote();
+}
+
+inline void JSONWriter::value(std::string_view str) {
+  separate();
+  dump_string(str, buffer);
+  wrote();
+}
+
+inline void JSONWriter::value(JSONObject const &obj) {
+  separate();
+  dump(obj, buffer);
+  wrote();
+}
+
+inline void JSONWriter::end_line() {
+#ifndef NDEBUG
+  assert(scopes.empty());
+#endif
+  buffer += '\n';
+  wrote();
+  comma = false;
+}
+
+inline bool JSONWriter::flush() {
+  for (size_t done = 0; fd >= 0 && done < buffer.size();) {
+    ssize_t put = write(fd, buffer.data() + done, buffer.size() - done);
+    if (put < 0 && errno == EINTR) {
+      continue;
+    }
+    if (put <= 0) {
+      failed = true;
+      break;
+    }
+    done += static_cast<size_t>(put);
+  }
+  if (fd >= 0) {
+    buffer.clear();
+  }
+  return !failed;
+}
+
+inline bool write_pieces(int fd, std::vector<std::string> const &pieces) {
+  std::vector<iovec> iov;
+  iov.reserve(pieces.size());
+  for (auto const &piece : pieces) {
+    if (!piece.empty()) {
+      iov.push_back({const_cast<char *>(piece.data()), piece.size()});
+    }
+  }
+
+  size_t done = 0;
+  while (done < iov.size()) {
+    int count = static_cast<int>(std::min<size_t>(iov.size() - done, IOV_MAX));
+    ssize_t n = writev(fd, iov.data() + done, count);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    // Skip what got written, resuming mid-piece after a short write
+    auto left = static_cast<size_t>(n);
+    while (done < iov.size() && left >= iov[done].iov_len) {
+      left -= iov[done].iov_len;
+      ++done;
+    }
+    if (done < iov.size()) {
+      iov[done].iov_base = static_cast<char *>(iov[done].iov_base) + left;
+      iov[done].iov_len -= left;
+    }
+  }
+  return true;
+}
+
+inline std::string key_text(JSONObject const &val) {
+  std::string text;
+  dump(val, text);
+  return text;
+}
+
+inline std::string group_text(JSONObject const &val) {
+  if (val.is_string()) {
+    return std::string(val.str());
+  }
+  std::string text;
+  dump(val, text);
+  return text;
+}
@@ -0,0 +1,468 @@
+// Lazy pipe operator for ranges
+// c++20
+//
+// 01-pipe applies each function eagerly to the whole vector. Here the
+// adaptors only describe a stage; nothing runs until a terminal
+// (to_vector / reduce) is attached. The stages are then nested into a single
+// push chain, so the source is walked once and every element travels
+// through all stages before the next one is read: one fused loop, no
+// intermediate vectors. take stops the walk early, and chunk hands out spans
+// (over the source when it is contiguous, else over one reused buffer).
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <ranges>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace lazy {
+
+// A sink receives elements one by one; returning false asks the producer
+// to stop. finish() is called exactly once when the input is exhausted, and
+// result() hands back whatever the terminal at the end of the chain built.
+
+template <typename... S> struct chain {
+  std::tuple<S...> stages;
+};
+
+template <std::ranges::view V, typename... S> struct pipeline {
+  V source;
+  std::tuple<S...> stages;
+};
+
+template <typename F> struct filter_stage {
+  F pred;
+
+  template <typename T> using out = T;
+
+  template <typename T, typename Next> struct sink {
+    F pred;
+    Next next;
+    bool operator()(T x) {
+      return !std::invoke(pred, std::as_const(x)) ||
+             next(std::forward<T>(x));
+    }
+    void finish() { next.finish(); }
+    auto result() { return next.result(); }
+  };
+
+  template <typename T, typename Next> auto connect(Next next) const {
+    return sink<T, Next>{pred, std::move(next)};
+  }
+};
+
+template <typename F> struct transform_stage {
+  F f;
+
+  template <typename T> using out = std::invoke_result_t<F const &, T>;
+
+  template <typename T, typename Next> struct sink {
+    F f;
+    Next next;
+    bool operator()(T x) { return next(std::invoke(f, std::forward<T>(x))); }
+    void finish() { next.finish(); }
+    auto result() { return next.result(); }
+  };
+
+  template <typename T, typename Next> auto connect(Next next) const {
+    return sink<T, Next>{f, std::move(next)};
+  }
+};
+
+struct take_stage {
+  std::size_t n;
+
+  template <typename T> using out = T;
+
+  template <typename T, typename Next> struct sink {
+    std::size_t left;
+    Next next;
+    bool operator()(T x) {
+      if (left == 0) {
+        return false;
+      }
+      --left;
+      return next(std::forward<T>(x)) && left > 0;
+    }
+    void finish() { next.finish(); }
+    auto result() { return next.result(); }
+  };
+
+  template <typename T, typename Next> auto connect(Next next) const {
+    return sink<T, Next>{n, std::move(next)};
+  }
+};
+
+// Downstream sees each chunk as a span over one buffer that is allocated
+// once and refilled in place, so a stage that only reads the chunk costs no
+// allocation or copy per chunk. The buffer is only reserved, so elements
+// need not be default-constructible.
+struct chunk_stage {
+  std::size_t n;
+
+  template <typename T> using out = std::span<std::remove_cvref_t<T> const>;
+
+  template <typename T, typename Next> struct sink {
+    Next next;
+    std::size_t n;
+    std::vector<std::remove_cvref_t<T>> buffer{};
+    bool open{true};
+    bool operator()(T x) {
+      buffer.push_back(std::forward<T>(x));
+      if (buffer.size() < n) {
+        return true;
+      }
+      open = next(std::span{std::as_const(buffer)});
+      buffer.clear();
+      return open;
+    }
+    void finish() {
+      if (open && !buffer.empty()) {
+        next(std::span{std::as_const(buffer)});
+      }
+      next.finish();
+    }
+    auto result() { return next.result(); }
+  };
+
+  template <typename T, typename Next> auto connect(Next next) const {
+    sink<T, Next> s{std::move(next), n};
+    s.buffer.reserve(n);
+    return s;
+  }
+};
+
+template <typename F> struct flat_map_stage {
+  F f;
+
+  template <typename T>
+  using out =
+      std::ranges::range_reference_t<std::invoke_result_t<F const &, T>>;
+
+  template <typename T, typename Next> struct sink {
+    F f;
+    Next next;
+    bool operator()(T x) {
+      auto &&inner = std::invoke(f, std::forward<T>(x));
+      for (auto &&y : inner) {
+        if (!next(std::forward<decltype(y)>(y))) {
+          return false;
+        }
+      }
+      return true;
+    }
+    void finish() { next.finish(); }
+    auto result() { return next.result(); }
+  };
+
+  template <typename T, typename Next> auto connect(Next next) const {
+    return sink<T, Next>{f, std::move(next)};
+  }
+};
+
+struct to_vector {
+  template <typename T> struct sink {
+    std::vector<std::remove_cvref_t<T>> values{};
+    bool operator()(T x) {
+      values.push_back(std::forward<T>(x));
+      return true;
+    }
+    void finish() {}
+    auto result() { return std::move(values); }
+  };
+
+  template <typename T> auto connect() const { return sink<T>{}; }
+};
+
+template <typename Init, typename Op> struct reduce {
+  Init init;
+  Op op{};
+
+  template <typename T> struct sink {
+    Init acc;
+    Op op;
+    bool operator()(T x) {
+      acc = std::invoke(op, std::move(acc), std::forward<T>(x));
+      return true;
+    }
+    void finish() {}
+    auto result() { return std::move(acc); }
+  };
+
+  template <typename T> auto connect() const { return sink<T>{init, op}; }
+};
+
+template <typename Init, typename Op = std::plus<>>
+reduce(Init, Op = {}) -> reduce<Init, Op>;
+
+template <typename T> struct is_terminal : std::false_type {};
+template <> struct is_terminal<to_vector> : std::true_type {};
+template <typename I, typename O>
+struct is_terminal<reduce<I, O>> : std::true_type {};
+
+template <typename T>
+concept terminal = is_terminal<std::remove_cvref_t<T>>::value;
+
+template <typename F> auto filter(F pred) {
+  return chain<filter_stage<F>>{{filter_stage<F>{std::move(pred)}}};
+}
+
+template <typename F> auto transform(F f) {
+  return chain<transform_stage<F>>{{transform_stage<F>{std::move(f)}}};
+}
+
+inline auto take(std::size_t n) { return chain<take_stage>{{take_stage{n}}}; }
+
+// Like std::views::chunk, n must be positive.
+inline auto chunk(std::size_t n) {
+  assert(n > 0);
+  return chain<chunk_stage>{{chunk_stage{n}}};
+}
+
+template <typename F> auto flat_map(F f) {
+  return chain<flat_map_stage<F>>{{flat_map_stage<F>{std::move(f)}}};
+}
+
+// Builds the sink for stage I onwards, given that stage I receives T.
+template <typename T, std::size_t I, typename Stages, typename Term>
+auto connect(Stages const &stages, Term const &term) {
+  if constexpr (I == std::tuple_size_v<Stages>) {
+    return term.template connect<T>();
+  } else {
+    auto const &stage = std::get<I>(stages);
+    using Out = typename std::remove_cvref_t<decltype(stage)>::template out<T>;
+    return stage.template connect<T>(connect<Out, I + 1>(stages, term));
+  }
+}
+
+template <typename Stages> constexpr bool starts_with_chunk() {
+  if constexpr (std::tuple_size_v<Stages> == 0) {
+    return false;
+  } else {
+    return std::is_same_v<std::tuple_element_t<0, Stages>, chunk_stage>;
+  }
+}
+
+template <std::ranges::view V, typename Stages, typename Term>
+auto run(V &source, Stages const &stages, Term const &term) {
+  // Chunks of a contiguous source are already contiguous: hand out spans
+  // over the source instead of copying through the chunk buffer.
+  if constexpr (std::ranges::contiguous_range<V> &&
+                std::ranges::sized_range<V> && starts_with_chunk<Stages>()) {
+    using Chunk = chunk_stage::out<std::ranges::range_reference_t<V>>;
+    auto sink = connect<Chunk, 1>(stages, term);
+    Chunk all{std::ranges::data(source), std::ranges::size(source)};
+    std::size_t n = std::get<0>(stages).n;
+    // Full chunks first, so the loop does not clamp every chunk's length
+    std::size_t i = 0;
+    bool open = true;
+    for (; open && all.size() - i >= n; i += n) {
+      open = sink(Chunk{all.data() + i, n});
+    }
+    if (open && i < all.size()) {
+      sink(all.subspan(i));
+    }
+    sink.finish();
+    return sink.result();
+  } else {
+    auto sink = connect<std::ranges::range_reference_t<V>, 0>(stages, term);
+    for (auto &&x : source) {
+      if (!sink(std::forward<decltype(x)>(x))) {
+        break;
+      }
+    }
+    sink.finish();
+    return sink.result();
+  }
+}
+
+template <typename... A, typename... B>
+auto operator|(chain<A...> a, chain<B...> b) {
+  return chain<A..., B...>{
+      std::tuple_cat(std::move(a.stages), std::move(b.stages))};
+}
+
+template <std::ranges::viewable_range R, typename... S>
+auto operator|(R &&r, chain<S...> c) {
+  return pipeline<std::views::all_t<R>, S...>{
+      std::views::all(std::forward<R>(r)), std::move(c.stages)};
+}
+
+template <typename V, typename... A, typename... B>
+auto operator|(pipeline<V, A...> p, chain<B...> c) {
+  return pipeline<V, A..., B...>{
+      std::move(p.source),
+      std::tuple_cat(std::move(p.stages), std::move(c.stages))};
+}
+
+template <typename V, typename... S>
+auto operator|(pipeline<V, S...> p, terminal auto const &term) {
+  return run(p.source, p.stages, term);
+}
+
+template <std::ranges::viewable_range R>
+auto operator|(R &&r, terminal auto const &term) {
+  auto source = std::views::all(std::forward<R>(r));
+  return run(source, std::tuple<>{}, term);
+}
+
+} // namespace lazy
+
+namespace {
+
+template <typename F> double bench(F f) {
+  using clock = std::chrono::steady_clock;
+  double best = 1e300;
+  for (int round = 0; round < 5; ++round) {
+    auto start = clock::now();
+    f();
+    std::chrono::duration<double, std::milli> took = clock::now() - start;
+    best = std::min(best, took.count());
+  }
+  return best;
+}
+
+template <typename T>
+void report(char const *name, T fused, T loop, double fused_ms,
+            double loop_ms) {
+  std::cout << name << ": fused " << fused_ms << " ms, loop " << loop_ms
+            << " ms" << (fused == loop ? "" : "  MISMATCH") << '\n';
+}
+
+} // namespace
+
+int main() {
+  using namespace lazy;
+
+  std::vector v{1, 2, 3, 4, 5, 6, 7};
+  auto squares = v | filter([](int i) { return i % 2 == 1; }) |
+                 transform([](int i) { return i * i; }) | to_vector{};
+  for (int i : squares) {
+    std::cout << i << ' ';
+  }
+  std::cout << '\n';
+
+  auto pairs = v | chunk(3) | transform([](std::span<int const> c) {
+                 return std::accumulate(c.begin(), c.end(), 0);
+               }) |
+               to_vector{};
+  for (int i : pairs) {
+    std::cout << i << ' ';
+  }
+  std::cout << '\n';
+
+  auto stage = flat_map([](int i) { return std::array{i, -i}; }) | take(5);
+  for (int i : v | stage | to_vector{}) {
+    std::cout << i << ' ';
+  }
+  std::cout << '\n';
+
+  std::vector<std::int64_t> data(10'000'000);
+  std::iota(data.begin(), data.end(), 0);
+
+  {
+    std::int64_t fused{}, loop{};
+    auto f = bench([&] {
+      fused = data | filter([](std::int64_t i) { return i % 3 == 0; }) |
+              transform([](std::int64_t i) { return i * i; }) |
+              reduce{std::int64_t{}};
+    });
+    auto l = bench([&] {
+      loop = 0;
+      for (auto i : data) {
+        if (i % 3 == 0) {
+          loop += i * i;
+        }
+      }
+    });
+    report("filter|transform|reduce", fused, loop, f, l);
+  }
+
+  {
+    std::vector<std::int64_t> fused, loop;
+    auto f = bench([&] {
+      fused = data | transform([](std::int64_t i) { return i ^ 0x55; }) |
+              filter([](std::int64_t i) { return i % 7 == 0; }) |
+              take(1'000'000) | to_vector{};
+    });
+    auto l = bench([&] {
+      loop.clear();
+      for (auto i : data) {
+        auto x = i ^ 0x55;
+        if (x % 7 == 0) {
+          loop.push_back(x);
+          if (loop.size() == 1'000'000) {
+            break;
+          }
+        }
+      }
+    });
+    report("transform|filter|take|to_vector", fused, loop, f, l);
+  }
+
+  {
+    std::int64_t fused{}, loop{};
+    std::size_t n = 4;
+    auto f = bench([&] {
+      fused = data | chunk(n) |
+              transform([](std::span<std::int64_t const> c) {
+                return std::accumulate(c.begin(), c.end(), std::int64_t{}) *
+                       c.back();
+              }) |
+              reduce{std::int64_t{}};
+    });
+    // The same runtime chunk size and per-chunk work as the pipeline. A loop
+    // that hard-codes chunks of 4 lets the compiler unroll them and is still
+    // about 10% faster than either.
+    auto l = bench([&] {
+      loop = 0;
+      for (std::size_t i = 0; i < data.size(); i += n) {
+        auto first = data.begin() + static_cast<std::ptrdiff_t>(i);
+        auto last = first + static_cast<std::ptrdiff_t>(
+                                std::min(n, data.size() - i));
+        loop += std::accumulate(first, last, std::int64_t{}) * last[-1];
+      }
+    });
+    report("chunk|transform|reduce", fused, loop, f, l);
+  }
+
+  {
+    std::int64_t fused{}, loop{};
+    auto f = bench([&] {
+      fused = data |
+              flat_map([](std::int64_t i) { return std::array{i, i >> 1}; }) |
+              reduce{std::int64_t{}, [](std::int64_t a, std::int64_t b) {
+                       return a ^ (b * 31);
+                     }};
+    });
+    auto l = bench([&] {
+      loop = 0;
+      for (auto i : data) {
+        loop ^= i * 31;
+        loop ^= (i >> 1) * 31;
+      }
+    });
+    report("flat_map|reduce", fused, loop, f, l);
+  }
+}
+
+// Output (g++ 12 -O2, best of 5 runs; timings vary by machine and run):
+// 1 9 25 49
+// 6 15 7
+// 1 -1 2 -2 3
+// filter|transform|reduce: fused 21.052 ms, loop 23.2891 ms
+// transform|filter|take|to_vector: fused 16.9168 ms, loop 15.6283 ms
+// chunk|transform|reduce: fused 16.5918 ms, loop 17.8429 ms
+// flat_map|reduce: fused 22.0667 ms, loop 22.2839 ms
+//
+// Over repeated runs fused and hand-written loops stay within about 10% of
+// each other either way; transform|filter|take|to_vector is the one where
+// the loop is most often ahead.